@@ -0,0 +1,1901 @@
+#define _GNU_SOURCE
+
+#include "fixtures.h"
+#include "framework.h"
+#include "units.h"
+
+#include "compat/crc32c.h"
+#include "compat/dm-block-manager.h"
+#include "compat/io-engine.h"
+#include "compat/sim-disk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//--------------------------------------------------------
+
+#define BLOCK_SIZE 4096
+#define NR_BLOCKS 128
+#define CACHE_SIZE 16
+#define MAX_HELD 4
+
+//--------------------------------------------------------
+
+struct fixture {
+	// Points at file, ram, or a sim disk wrapping ram.
+	struct block_device *bdev;
+	struct block_device file;
+	struct block_device *ram;
+	struct dm_block_manager *bm;
+};
+
+static struct fixture *create_fixture_(bool ram)
+{
+	struct fixture *fix = malloc(sizeof(*fix));
+	T_ASSERT(fix);
+
+	if (ram) {
+		fix->ram = fix->bdev = ram_disk_create((uint64_t) BLOCK_SIZE * NR_BLOCKS);
+		T_ASSERT(fix->bdev);
+	} else {
+		block_device_init_fd(&fix->file, create_block_file(BLOCK_SIZE, NR_BLOCKS));
+		fix->bdev = &fix->file;
+		fix->ram = NULL;
+	}
+	fix->bm = NULL;
+
+	return fix;
+}
+
+static void *create_bm_()
+{
+	struct fixture *fix = create_fixture_(false);
+
+	fix->bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(fix->bm);
+
+	return fix;
+}
+
+static void destroy_bm_(void *context)
+{
+	struct fixture *fix = context;
+
+	if (fix->bm)
+		dm_block_manager_destroy(fix->bm);
+
+	if (fix->bdev != &fix->file && fix->bdev != fix->ram)
+		sim_disk_destroy(fix->bdev);
+
+	if (fix->ram)
+		ram_disk_destroy(fix->ram);
+	else
+		close(fix->file.fd);
+
+	free(fix);
+}
+
+//--------------------------------------------------------
+
+static void fill_block_(struct dm_block_manager *bm, dm_block_t b, uint8_t pattern)
+{
+	struct dm_block *blk;
+
+	T_ASSERT(!dm_bm_write_lock(bm, b, NULL, &blk));
+	memset(dm_block_data(blk), pattern, BLOCK_SIZE);
+	dm_bm_unlock(blk);
+}
+
+static void check_block_(struct dm_block_manager *bm, dm_block_t b, uint8_t pattern)
+{
+	unsigned i;
+	struct dm_block *blk;
+	uint8_t *data;
+
+	T_ASSERT(!dm_bm_read_lock(bm, b, NULL, &blk));
+	data = dm_block_data(blk);
+	for (i = 0; i < BLOCK_SIZE; i++)
+		T_ASSERT_EQUAL(data[i], pattern);
+	dm_bm_unlock(blk);
+}
+
+// Writes straight to the device, behind the block manager's back.  The
+// buffers are aligned so these work with O_DIRECT too.
+static void scribble_(struct fixture *fix, dm_block_t b, uint8_t pattern)
+{
+	uint8_t data[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+
+	memset(data, pattern, sizeof(data));
+	T_ASSERT(!bdev_write(fix->bdev, data, BLOCK_SIZE, b * BLOCK_SIZE));
+}
+
+// Reads straight from the device, behind the block manager's back.
+static void check_on_disk_(struct fixture *fix, dm_block_t b, uint8_t pattern)
+{
+	unsigned i;
+	uint8_t data[BLOCK_SIZE] __attribute__((aligned(BLOCK_SIZE)));
+
+	T_ASSERT(!bdev_read(fix->bdev, data, BLOCK_SIZE, b * BLOCK_SIZE));
+	for (i = 0; i < BLOCK_SIZE; i++)
+		T_ASSERT_EQUAL(data[i], pattern);
+}
+
+//--------------------------------------------------------
+
+static void test_read_after_write(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	for (b = 0; b < NR_BLOCKS; b++)
+		fill_block_(fix->bm, b, b);
+
+	for (b = 0; b < NR_BLOCKS; b++)
+		check_block_(fix->bm, b, b);
+}
+
+static void test_resident_across_unlock(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	check_block_(fix->bm, 0, 0);
+
+	// Still cached, so the scribble isn't seen.
+	scribble_(fix, 0, 0xff);
+	check_block_(fix->bm, 0, 0);
+
+	// Push block 0 out of the cache.
+	for (b = 1; b <= CACHE_SIZE; b++)
+		check_block_(fix->bm, b, 0);
+
+	check_block_(fix->bm, 0, 0xff);
+}
+
+static void test_held_blocks_are_not_recycled(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	dm_block_t b;
+
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 0, NULL, &blk));
+	for (b = 1; b < NR_BLOCKS; b++)
+		check_block_(fix->bm, b, 0);
+
+	T_ASSERT_EQUAL(dm_block_location(blk), 0);
+	dm_bm_unlock(blk);
+}
+
+static void test_write_back(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	fill_block_(fix->bm, 0, 1);
+	fill_block_(fix->bm, 0, 2);
+	check_on_disk_(fix, 0, 0);
+
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 0, 2);
+
+	// Recycling a dirty block writes it.
+	fill_block_(fix->bm, 1, 3);
+	for (b = 2; b <= CACHE_SIZE + 1; b++)
+		check_block_(fix->bm, b, 0);
+	check_on_disk_(fix, 1, 3);
+}
+
+static void test_prefetch(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	for (b = 0; b < CACHE_SIZE; b++)
+		scribble_(fix, b, b + 1);
+
+	for (b = 0; b < CACHE_SIZE; b++)
+		dm_bm_prefetch(fix->bm, b);
+
+	// Out of range prefetches are ignored.
+	dm_bm_prefetch(fix->bm, NR_BLOCKS);
+
+	for (b = 0; b < CACHE_SIZE; b++)
+		check_block_(fix->bm, b, b + 1);
+}
+
+static void test_prefetch_then_write(void *context)
+{
+	struct fixture *fix = context;
+
+	scribble_(fix, 0, 1);
+	dm_bm_prefetch(fix->bm, 0);
+	fill_block_(fix->bm, 0, 2);
+	check_block_(fix->bm, 0, 2);
+
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 0, 2);
+}
+
+static void test_flush_runs(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	unsigned i;
+	dm_block_t b;
+
+	// Out of order, with some runs and some gaps.
+	static const dm_block_t blocks[] = {9, 3, 4, 0, 12, 5, 1, 10, 20, 11, 2};
+	const unsigned nr = sizeof(blocks) / sizeof(*blocks);
+
+	for (i = 0; i < nr; i++)
+		fill_block_(fix->bm, blocks[i], blocks[i] + 1);
+
+	// Cache some of the gaps clean, then change all of them behind the
+	// bm's back.  A run that spanned a gap would overwrite them.
+	for (b = 6; b < 9; b++)
+		check_block_(fix->bm, b, 0);
+	check_block_(fix->bm, 13, 0);
+	check_block_(fix->bm, 19, 0);
+	for (b = 6; b < 20; b++)
+		if (b < 9 || b > 12)
+			scribble_(fix, b, 0xff);
+
+	dm_bm_reset_stats(fix->bm);
+	T_ASSERT(!dm_bm_flush(fix->bm));
+
+	// One write for each of the runs 0-5, 9-12 and 20.
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.bytes_written, nr * BLOCK_SIZE);
+	T_ASSERT_EQUAL(stats.writes, 3);
+
+	for (i = 0; i < nr; i++)
+		check_on_disk_(fix, blocks[i], blocks[i] + 1);
+
+	for (b = 6; b < 20; b++)
+		if (b < 9 || b > 12)
+			check_on_disk_(fix, b, 0xff);
+}
+
+static void test_flush_locked(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+
+	// Dirty blocks are written even if they're read locked.
+	fill_block_(fix->bm, 0, 1);
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 0, NULL, &blk));
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 0, 1);
+	dm_bm_unlock(blk);
+
+	// But not if we have one write locked.
+	fill_block_(fix->bm, 1, 2);
+	fill_block_(fix->bm, 2, 3);
+	T_ASSERT(!dm_bm_write_lock(fix->bm, 1, NULL, &blk));
+	T_ASSERT_EQUAL(dm_bm_flush(fix->bm), -EBUSY);
+	check_on_disk_(fix, 2, 0);
+	dm_bm_unlock(blk);
+
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 1, 2);
+	check_on_disk_(fix, 2, 3);
+}
+
+//--------------------------------------------------------
+
+static unsigned nr_checks_;
+
+static void prepare_nothing_(struct dm_block_validator *v, struct dm_block *b, size_t block_size)
+{
+}
+
+static int count_check_(struct dm_block_validator *v, struct dm_block *b, size_t block_size)
+{
+	nr_checks_++;
+	return 0;
+}
+
+static struct dm_block_validator counting_validator_ = {
+	.name = "counting",
+	.prepare_for_write = prepare_nothing_,
+	.check = count_check_
+};
+
+// Rejects blocks that start with 0xff.
+static int reject_ff_(struct dm_block_validator *v, struct dm_block *b, size_t block_size)
+{
+	nr_checks_++;
+	return *((uint8_t *) dm_block_data(b)) == 0xff ? -EILSEQ : 0;
+}
+
+static struct dm_block_validator rejecting_validator_ = {
+	.name = "rejecting",
+	.prepare_for_write = prepare_nothing_,
+	.check = reject_ff_
+};
+
+static int accept_all_(struct dm_block_validator *v, struct dm_block *b, size_t block_size)
+{
+	return 0;
+}
+
+// Blocks starting with a non-zero byte are internal nodes, others leaves.
+static enum dm_block_class classify_first_byte_(struct dm_block_validator *v,
+						struct dm_block *b, size_t block_size)
+{
+	uint8_t *data = dm_block_data(b);
+	return data[0] ? DM_BLOCK_BTREE_INTERNAL : DM_BLOCK_BTREE_LEAF;
+}
+
+static struct dm_block_validator classifying_validator_ = {
+	.name = "classifying",
+	.prepare_for_write = prepare_nothing_,
+	.check = accept_all_,
+	.classify = classify_first_byte_
+};
+
+static void lock_classified_(struct dm_block_manager *bm, dm_block_t b)
+{
+	struct dm_block *blk;
+
+	T_ASSERT(!dm_bm_read_lock(bm, b, &classifying_validator_, &blk));
+	dm_bm_unlock(blk);
+}
+
+// Stamps each block with its location and a checksum of the rest.
+static void stamp_(struct dm_block_validator *v, struct dm_block *b, size_t block_size)
+{
+	uint8_t *data = dm_block_data(b);
+	uint64_t loc = dm_block_location(b);
+	u32 csum;
+
+	memcpy(data, &loc, sizeof(loc));
+	csum = dm_bm_checksum(data, block_size - sizeof(csum), 0);
+	memcpy(data + block_size - sizeof(csum), &csum, sizeof(csum));
+}
+
+static struct dm_block_validator stamping_validator_ = {
+	.name = "stamping",
+	.prepare_for_write = stamp_,
+	.check = accept_all_
+};
+
+static void test_validated_once(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	unsigned i;
+
+	nr_checks_ = 0;
+	for (i = 0; i < 10; i++) {
+		T_ASSERT(!dm_bm_read_lock(fix->bm, 0, &counting_validator_, &blk));
+		dm_bm_unlock(blk);
+	}
+	T_ASSERT_EQUAL(nr_checks_, 1);
+
+	// Our own writes don't need checking either.
+	T_ASSERT(!dm_bm_write_lock(fix->bm, 0, &counting_validator_, &blk));
+	dm_bm_unlock(blk);
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 0, &counting_validator_, &blk));
+	dm_bm_unlock(blk);
+	T_ASSERT_EQUAL(nr_checks_, 1);
+}
+
+static void test_failed_check_not_cached(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+
+	scribble_(fix, 0, 0xff);
+	nr_checks_ = 0;
+	T_ASSERT_EQUAL(dm_bm_read_lock(fix->bm, 0, &rejecting_validator_, &blk), -EILSEQ);
+	T_ASSERT_EQUAL(dm_bm_read_lock(fix->bm, 0, &rejecting_validator_, &blk), -EILSEQ);
+	T_ASSERT_EQUAL(nr_checks_, 2);
+
+	// Once the disk is fixed the block reads back.
+	scribble_(fix, 0, 0);
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 0, &rejecting_validator_, &blk));
+	dm_bm_unlock(blk);
+}
+
+static void test_failed_prefetch_check(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+
+	scribble_(fix, 0, 0xff);
+	dm_bm_prefetch(fix->bm, 0);
+	T_ASSERT_EQUAL(dm_bm_write_lock(fix->bm, 0, &rejecting_validator_, &blk), -EILSEQ);
+
+	scribble_(fix, 0, 0);
+	T_ASSERT(!dm_bm_write_lock(fix->bm, 0, &rejecting_validator_, &blk));
+	dm_bm_unlock(blk);
+}
+
+//--------------------------------------------------------
+
+static void test_max_held(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blks[MAX_HELD], *blk;
+	dm_block_t b;
+
+	for (b = 0; b < MAX_HELD; b++)
+		T_ASSERT(!dm_bm_read_lock(fix->bm, b, NULL, blks + b));
+
+	T_ASSERT_EQUAL(dm_bm_read_lock(fix->bm, MAX_HELD, NULL, &blk), -EINVAL);
+
+	dm_bm_unlock(blks[0]);
+	T_ASSERT(!dm_bm_read_lock(fix->bm, MAX_HELD, NULL, &blk));
+	dm_bm_unlock(blk);
+
+	for (b = 1; b < MAX_HELD; b++)
+		dm_bm_unlock(blks[b]);
+}
+
+#define NR_READERS 4
+#define NR_THREAD_LOCKS 20000
+
+struct thread_context {
+	struct dm_block_manager *bm;
+	unsigned seed;
+	unsigned nr_errors;
+};
+
+/*
+ * Each block is always entirely filled with one value, so a reader that
+ * sees two different values has seen a partial write.
+ */
+static bool block_consistent_(uint8_t *data)
+{
+	unsigned i;
+
+	for (i = 1; i < BLOCK_SIZE; i++)
+		if (data[i] != data[0])
+			return false;
+
+	return true;
+}
+
+static void *reader_(void *context)
+{
+	struct thread_context *tc = context;
+	struct dm_block *blk;
+	unsigned i;
+
+	for (i = 0; i < NR_THREAD_LOCKS; i++) {
+		if (dm_bm_read_lock(tc->bm, rand_r(&tc->seed) % NR_BLOCKS, NULL, &blk)) {
+			tc->nr_errors++;
+			continue;
+		}
+
+		if (!block_consistent_(dm_block_data(blk)))
+			tc->nr_errors++;
+		dm_bm_unlock(blk);
+	}
+
+	return NULL;
+}
+
+static void *writer_(void *context)
+{
+	struct thread_context *tc = context;
+	struct dm_block *blk;
+	unsigned i, j;
+	volatile uint8_t *data;
+
+	for (i = 0; i < NR_THREAD_LOCKS; i++) {
+		if (dm_bm_write_lock(tc->bm, rand_r(&tc->seed) % NR_BLOCKS, NULL, &blk)) {
+			tc->nr_errors++;
+			continue;
+		}
+
+		// Byte at a time, to give readers a chance to see a torn block.
+		data = dm_block_data(blk);
+		for (j = 0; j < BLOCK_SIZE; j++)
+			data[j] = i;
+		dm_bm_unlock(blk);
+	}
+
+	return NULL;
+}
+
+static void test_concurrent_readers_and_writer(void *context)
+{
+	struct fixture *fix = context;
+	struct thread_context tcs[NR_READERS + 1];
+	pthread_t threads[NR_READERS + 1];
+	unsigned i;
+
+	for (i = 0; i <= NR_READERS; i++) {
+		tcs[i].bm = fix->bm;
+		tcs[i].seed = i;
+		tcs[i].nr_errors = 0;
+		T_ASSERT(!pthread_create(threads + i, NULL, i ? reader_ : writer_, tcs + i));
+	}
+
+	for (i = 0; i <= NR_READERS; i++) {
+		T_ASSERT(!pthread_join(threads[i], NULL));
+		T_ASSERT_EQUAL(tcs[i].nr_errors, 0);
+	}
+}
+
+//--------------------------------------------------------
+
+static void test_class_stats(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	struct dm_block *blk;
+
+	dm_bm_set_readahead(fix->bm, 0);
+	scribble_(fix, 0, 1);
+
+	lock_classified_(fix->bm, 0);
+	lock_classified_(fix->bm, 0);
+	lock_classified_(fix->bm, 1);
+
+	// Unlocking a write lock reclassifies the block.
+	T_ASSERT(!dm_bm_write_lock(fix->bm, 1, &classifying_validator_, &blk));
+	memset(dm_block_data(blk), 1, BLOCK_SIZE);
+	dm_bm_unlock(blk);
+	lock_classified_(fix->bm, 1);
+
+	check_block_(fix->bm, 2, 0);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_INTERNAL].misses, 1);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_INTERNAL].hits, 2);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_LEAF].misses, 1);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_LEAF].hits, 1);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_OTHER].misses, 1);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_OTHER].hits, 0);
+}
+
+static void test_internal_nodes_outlive_leaves(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	dm_block_t b;
+
+	dm_bm_set_readahead(fix->bm, 0);
+	scribble_(fix, 0, 1);
+
+	lock_classified_(fix->bm, 0);
+	lock_classified_(fix->bm, 1);
+
+	// Enough leaves to push a leaf out of the cache twice over.
+	for (b = 2; b < 2 + 2 * CACHE_SIZE; b++)
+		lock_classified_(fix->bm, b);
+
+	dm_bm_reset_stats(fix->bm);
+	lock_classified_(fix->bm, 0);
+	lock_classified_(fix->bm, 1);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_INTERNAL].hits, 1);
+	T_ASSERT_EQUAL(stats.classes[DM_BLOCK_BTREE_LEAF].misses, 1);
+}
+
+static void test_parallel_prepare(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	uint8_t data[BLOCK_SIZE];
+	uint64_t loc;
+	u32 csum;
+	dm_block_t b;
+
+	// Big enough that nothing's written back before the flush.
+	dm_block_manager_destroy(fix->bm);
+	fix->bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, NR_BLOCKS);
+	T_ASSERT(fix->bm);
+	dm_bm_set_flush_threads(fix->bm, 4);
+
+	// Gaps, so there are several runs.
+	for (b = 0; b < NR_BLOCKS; b++)
+		if (b % 7) {
+			T_ASSERT(!dm_bm_write_lock_zero(fix->bm, b, &stamping_validator_, &blk));
+			memset(dm_block_data(blk), b, BLOCK_SIZE);
+			dm_bm_unlock(blk);
+		}
+	T_ASSERT(!dm_bm_flush(fix->bm));
+
+	for (b = 0; b < NR_BLOCKS; b++) {
+		T_ASSERT(!bdev_read(fix->bdev, data, BLOCK_SIZE, b * BLOCK_SIZE));
+		if (!(b % 7)) {
+			T_ASSERT_EQUAL(data[BLOCK_SIZE / 2], 0);
+			continue;
+		}
+
+		memcpy(&loc, data, sizeof(loc));
+		memcpy(&csum, data + BLOCK_SIZE - sizeof(csum), sizeof(csum));
+		T_ASSERT_EQUAL(loc, b);
+		T_ASSERT_EQUAL(data[BLOCK_SIZE / 2], (uint8_t) b);
+		T_ASSERT_EQUAL(csum, dm_bm_checksum(data, BLOCK_SIZE - sizeof(csum), 0));
+	}
+
+	// Flushing with nothing dirty, and without threads, still works.
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	dm_bm_set_flush_threads(fix->bm, 0);
+	fill_block_(fix->bm, 0, 0x11);
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 0, 0x11);
+}
+
+static void test_try_lock_miss(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	struct dm_block *blk;
+
+	scribble_(fix, 0, 0x42);
+
+	// The miss starts a prefetch, which the blocking lock picks up.
+	T_ASSERT_EQUAL(dm_bm_read_try_lock(fix->bm, 0, NULL, &blk), -EWOULDBLOCK);
+	check_block_(fix->bm, 0, 0x42);
+
+	T_ASSERT(!dm_bm_read_try_lock(fix->bm, 0, NULL, &blk));
+	T_ASSERT_EQUAL(((uint8_t *) dm_block_data(blk))[0], 0x42);
+	dm_bm_unlock(blk);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.would_blocks, 1);
+	T_ASSERT_EQUAL(stats.prefetches_issued, 1);
+	T_ASSERT_EQUAL(stats.prefetches_used, 1);
+}
+
+static void test_try_lock_after_failed_prefetch(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	dm_block_t b = NR_BLOCKS - 1;
+
+	// Cutting the last block off the file makes its prefetch read short.
+	T_ASSERT(!ftruncate(fix->file.fd, (off_t) b * BLOCK_SIZE));
+	dm_bm_prefetch(fix->bm, b);
+	usleep(100000);
+	T_ASSERT(!ftruncate(fix->file.fd, (off_t) NR_BLOCKS * BLOCK_SIZE));
+	scribble_(fix, b, 0x42);
+
+	// The blocking lock rereads it, after which it's like any other
+	// cached block.
+	check_block_(fix->bm, b, 0x42);
+	T_ASSERT(!dm_bm_read_try_lock(fix->bm, b, NULL, &blk));
+	T_ASSERT_EQUAL(((uint8_t *) dm_block_data(blk))[0], 0x42);
+	dm_bm_unlock(blk);
+}
+
+static void test_try_lock_write_locked(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *wblk, *blk;
+	unsigned i;
+
+	T_ASSERT(!dm_bm_write_lock(fix->bm, 0, NULL, &wblk));
+
+	// Failures mustn't leak held locks, or this would hit max_held.
+	for (i = 0; i < 2 * MAX_HELD; i++)
+		T_ASSERT_EQUAL(dm_bm_read_try_lock(fix->bm, 0, NULL, &blk), -EWOULDBLOCK);
+	dm_bm_unlock(wblk);
+
+	T_ASSERT(!dm_bm_read_try_lock(fix->bm, 0, NULL, &blk));
+	T_ASSERT(!dm_bm_read_try_lock(fix->bm, 0, NULL, &wblk));
+	T_ASSERT(blk == wblk);
+	dm_bm_unlock(blk);
+	dm_bm_unlock(wblk);
+}
+
+static void test_move(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	struct dm_block *blk;
+
+	fill_block_(fix->bm, 0, 1);
+	check_block_(fix->bm, 1, 0);
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	dm_bm_reset_stats(fix->bm);
+
+	// The stale copy of block 1 is dropped.
+	T_ASSERT(!dm_bm_write_lock_move(fix->bm, 0, 1, NULL, &blk));
+	T_ASSERT_EQUAL(dm_block_location(blk), 1);
+	T_ASSERT_EQUAL(((uint8_t *) dm_block_data(blk))[0], 1);
+	memset(dm_block_data(blk), 2, BLOCK_SIZE);
+	dm_bm_unlock(blk);
+
+	T_ASSERT(!dm_bm_flush(fix->bm));
+	check_on_disk_(fix, 0, 1);
+	check_on_disk_(fix, 1, 2);
+
+	// Block 0 has to be read again.
+	check_block_(fix->bm, 0, 1);
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.moves, 1);
+	T_ASSERT_EQUAL(stats.misses, 1);
+	T_ASSERT_EQUAL(stats.bytes_read, BLOCK_SIZE);
+}
+
+static void test_move_refused(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk, *held;
+	unsigned i;
+
+	fill_block_(fix->bm, 0, 1);
+	check_block_(fix->bm, 1, 0);
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 2, NULL, &held));
+
+	// Failures mustn't leak held locks, or this would hit max_held.
+	for (i = 0; i < 2 * MAX_HELD; i++) {
+		// Dirty.
+		T_ASSERT_EQUAL(dm_bm_write_lock_move(fix->bm, 0, 3, NULL, &blk), -ENODATA);
+
+		// Held.
+		T_ASSERT_EQUAL(dm_bm_write_lock_move(fix->bm, 2, 3, NULL, &blk), -ENODATA);
+
+		// Not cached.
+		T_ASSERT_EQUAL(dm_bm_write_lock_move(fix->bm, 4, 3, NULL, &blk), -ENODATA);
+
+		// Different validator.
+		T_ASSERT_EQUAL(dm_bm_write_lock_move(fix->bm, 1, 3, &counting_validator_, &blk),
+			       -ENODATA);
+
+		// Destination held.
+		T_ASSERT_EQUAL(dm_bm_write_lock_move(fix->bm, 1, 2, NULL, &blk), -ENODATA);
+	}
+	dm_bm_unlock(held);
+
+	check_block_(fix->bm, 0, 1);
+	check_block_(fix->bm, 1, 0);
+}
+
+static void test_stats(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	struct dm_block *blk;
+
+	// The locks below are ascending, which would trigger readahead.
+	dm_bm_set_readahead(fix->bm, 0);
+
+	check_block_(fix->bm, 0, 0);
+	check_block_(fix->bm, 0, 0);
+	fill_block_(fix->bm, 1, 1);
+	T_ASSERT(!dm_bm_write_lock_zero(fix->bm, 2, NULL, &blk));
+	dm_bm_unlock(blk);
+
+	scribble_(fix, 3, 0xff);
+	T_ASSERT(dm_bm_read_lock(fix->bm, 3, &rejecting_validator_, &blk));
+
+	dm_bm_prefetch(fix->bm, 4);
+	dm_bm_prefetch(fix->bm, 5);
+	check_block_(fix->bm, 4, 0);
+
+	T_ASSERT(!dm_bm_flush(fix->bm));
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.read_locks, 4);
+	T_ASSERT_EQUAL(stats.write_locks, 1);
+	T_ASSERT_EQUAL(stats.zero_locks, 1);
+	T_ASSERT_EQUAL(stats.hits, 2);
+	T_ASSERT_EQUAL(stats.misses, 3);
+	T_ASSERT_EQUAL(stats.bytes_read, 5 * BLOCK_SIZE);
+	T_ASSERT_EQUAL(stats.bytes_written, 2 * BLOCK_SIZE);
+
+	// Blocks 1 and 2 are adjacent, so they're written together.
+	T_ASSERT_EQUAL(stats.writes, 1);
+	T_ASSERT_EQUAL(stats.validation_failures, 1);
+	T_ASSERT_EQUAL(stats.flushes, 1);
+	T_ASSERT_EQUAL(stats.prefetches_issued, 2);
+	T_ASSERT_EQUAL(stats.prefetches_used, 1);
+
+	dm_bm_reset_stats(fix->bm);
+	check_block_(fix->bm, 0, 0);
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.read_locks, 1);
+	T_ASSERT_EQUAL(stats.hits, 1);
+	T_ASSERT_EQUAL(stats.misses, 0);
+	T_ASSERT_EQUAL(stats.bytes_read, 0);
+}
+
+static void *lock_one_(void *context)
+{
+	struct dm_block_manager *bm = context;
+	struct dm_block *blk;
+
+	if (!dm_bm_read_lock(bm, 0, NULL, &blk))
+		dm_bm_unlock(blk);
+
+	return NULL;
+}
+
+static void test_stats_from_other_threads(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	pthread_t threads[NR_READERS];
+	unsigned i;
+
+	// Their counts must survive the threads exiting.
+	for (i = 0; i < NR_READERS; i++)
+		T_ASSERT(!pthread_create(threads + i, NULL, lock_one_, fix->bm));
+	for (i = 0; i < NR_READERS; i++)
+		T_ASSERT(!pthread_join(threads[i], NULL));
+
+	check_block_(fix->bm, 0, 0);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.read_locks, NR_READERS + 1);
+	T_ASSERT_EQUAL(stats.misses, 1);
+	T_ASSERT_EQUAL(stats.hits, NR_READERS);
+}
+
+static void test_readahead(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	dm_block_t b;
+
+	for (b = 0; b < NR_BLOCKS; b++)
+		scribble_(fix, b, b);
+
+	// Ascending, with the odd gap.
+	for (b = 0; b < NR_BLOCKS; b += (b % 5) ? 1 : 2)
+		check_block_(fix->bm, b, b);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT(stats.misses <= 3);
+	T_ASSERT(stats.prefetches_used >= stats.read_locks - 3);
+}
+
+static void test_no_readahead_for_random_locks(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_bm_stats stats;
+	static const dm_block_t blocks[] = {50, 3, 90, 20, 21, 7, 100, 64};
+	unsigned i;
+
+	for (i = 0; i < sizeof(blocks) / sizeof(*blocks); i++)
+		check_block_(fix->bm, blocks[i], 0);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.prefetches_issued, 0);
+}
+
+//--------------------------------------------------------
+
+static void *create_direct_bm_()
+{
+	struct fixture *fix = create_fixture_(false);
+
+	T_ASSERT(!fcntl(fix->file.fd, F_SETFL, O_DIRECT));
+
+	fix->bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(fix->bm);
+
+	return fix;
+}
+
+static void test_direct_buffers_aligned(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	dm_block_t b;
+
+	for (b = 0; b < CACHE_SIZE; b++) {
+		T_ASSERT(!dm_bm_read_lock(fix->bm, b, NULL, &blk));
+		T_ASSERT(!((uintptr_t) dm_block_data(blk) % BLOCK_SIZE));
+		dm_bm_unlock(blk);
+	}
+}
+
+//--------------------------------------------------------
+
+static void *create_mmap_bm_()
+{
+	return create_fixture_(false);
+}
+
+static void open_mmap_(struct fixture *fix)
+{
+	fix->bm = dm_block_manager_create_mmap(fix->bdev, BLOCK_SIZE, MAX_HELD);
+	T_ASSERT(fix->bm);
+}
+
+static void test_mmap_read(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	for (b = 0; b < NR_BLOCKS; b++)
+		scribble_(fix, b, b);
+
+	open_mmap_(fix);
+	T_ASSERT_EQUAL(dm_bm_nr_blocks(fix->bm), NR_BLOCKS);
+
+	for (b = 0; b < NR_BLOCKS; b++) {
+		dm_bm_prefetch(fix->bm, b);
+		check_block_(fix->bm, b, b);
+	}
+
+	// There's no copy, so changes to the file show through.
+	scribble_(fix, 0, 0xff);
+	check_block_(fix->bm, 0, 0xff);
+}
+
+static void test_mmap_is_read_only(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+
+	open_mmap_(fix);
+	T_ASSERT(dm_bm_is_read_only(fix->bm));
+	T_ASSERT_EQUAL(dm_bm_write_lock(fix->bm, 0, NULL, &blk), -EPERM);
+	T_ASSERT_EQUAL(dm_bm_write_lock_zero(fix->bm, 0, NULL, &blk), -EPERM);
+}
+
+static void test_mmap_out_of_range(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+
+	open_mmap_(fix);
+	T_ASSERT_EQUAL(dm_bm_read_lock(fix->bm, NR_BLOCKS, NULL, &blk), -EINVAL);
+	T_ASSERT_EQUAL(dm_bm_read_lock(fix->bm, NR_BLOCKS + 100000, NULL, &blk), -EINVAL);
+	T_ASSERT_EQUAL(dm_bm_read_try_lock(fix->bm, NR_BLOCKS + 100000, NULL, &blk), -EINVAL);
+
+	// Prefetches past the end are ignored.
+	dm_bm_prefetch(fix->bm, NR_BLOCKS + 100000);
+
+	T_ASSERT(!dm_bm_read_lock(fix->bm, NR_BLOCKS - 1, NULL, &blk));
+	dm_bm_unlock(blk);
+}
+
+static void test_mmap_validates_once(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	unsigned i;
+	dm_block_t b;
+
+	open_mmap_(fix);
+
+	nr_checks_ = 0;
+	for (i = 0; i < 3; i++)
+		for (b = 0; b < NR_BLOCKS; b++) {
+			T_ASSERT(!dm_bm_read_lock(fix->bm, b, &counting_validator_, &blk));
+			dm_bm_unlock(blk);
+		}
+
+	T_ASSERT_EQUAL(nr_checks_, NR_BLOCKS);
+}
+
+//--------------------------------------------------------
+
+#define ENGINE_NR_IOS 32
+
+struct engine_fixture {
+	int fd;
+	struct io_engine *e;
+};
+
+static void *create_engine_(struct io_engine *e)
+{
+	struct engine_fixture *fix = malloc(sizeof(*fix));
+	T_ASSERT(fix);
+
+	fix->fd = create_block_file(BLOCK_SIZE, ENGINE_NR_IOS);
+	fix->e = e;
+	T_ASSERT(fix->e);
+
+	return fix;
+}
+
+static void *create_uring_()
+{
+	return create_engine_(create_uring_io_engine(ENGINE_NR_IOS));
+}
+
+static void *create_threads_()
+{
+	return create_engine_(create_thread_io_engine(4, ENGINE_NR_IOS));
+}
+
+static void destroy_engine_(void *context)
+{
+	struct engine_fixture *fix = context;
+	fix->e->destroy(fix->e);
+	close(fix->fd);
+	free(fix);
+}
+
+static unsigned nr_completed_;
+
+static void count_completion_(void *context, int io_error)
+{
+	T_ASSERT(!io_error);
+	nr_completed_++;
+}
+
+static void run_ios_(struct engine_fixture *fix, enum dir d, uint8_t (*buffers)[BLOCK_SIZE])
+{
+	unsigned i;
+
+	nr_completed_ = 0;
+	for (i = 0; i < ENGINE_NR_IOS; i++)
+		T_ASSERT(fix->e->issue(fix->e, d, fix->fd, (off_t) i * BLOCK_SIZE,
+				       buffers[i], BLOCK_SIZE, NULL));
+
+	while (fix->e->wait(fix->e, count_completion_))
+		;
+	T_ASSERT_EQUAL(nr_completed_, ENGINE_NR_IOS);
+}
+
+static void test_engine_write_then_read(void *context)
+{
+	struct engine_fixture *fix = context;
+	unsigned i, j;
+	static uint8_t buffers[ENGINE_NR_IOS][BLOCK_SIZE];
+
+	T_ASSERT(fix->e->max_io(fix->e) >= ENGINE_NR_IOS);
+
+	for (i = 0; i < ENGINE_NR_IOS; i++)
+		memset(buffers[i], i, BLOCK_SIZE);
+	run_ios_(fix, DIR_WRITE, buffers);
+
+	memset(buffers, 0xff, sizeof(buffers));
+	run_ios_(fix, DIR_READ, buffers);
+
+	for (i = 0; i < ENGINE_NR_IOS; i++)
+		for (j = 0; j < BLOCK_SIZE; j++)
+			T_ASSERT_EQUAL(buffers[i][j], i);
+}
+
+static void record_error_(void *context, int io_error)
+{
+	*((int *) context) = io_error;
+}
+
+static void test_engine_short_read(void *context)
+{
+	struct engine_fixture *fix = context;
+	int error = 0;
+	static uint8_t buffer[BLOCK_SIZE];
+
+	// Reading past the end of the file comes back short.
+	T_ASSERT(fix->e->issue(fix->e, DIR_READ, fix->fd, (off_t) ENGINE_NR_IOS * BLOCK_SIZE,
+			       buffer, BLOCK_SIZE, &error));
+
+	T_ASSERT(fix->e->wait(fix->e, record_error_));
+	T_ASSERT_EQUAL(error, -EIO);
+	T_ASSERT(!fix->e->wait(fix->e, record_error_));
+}
+
+//--------------------------------------------------------
+
+static void test_checksum_known_value(void *context)
+{
+	const char *data = "123456789";
+
+	// The standard CRC32C check value, which has pre and post inversion.
+	T_ASSERT_EQUAL(dm_bm_checksum(data, strlen(data), 0xffffffff) ^ 0xffffffff, 0xe3069283);
+}
+
+#define CSUM_MAX_LEN (3 * BLOCK_SIZE)
+
+static void test_checksum_impls_agree(void *context)
+{
+	static uint8_t data[CSUM_MAX_LEN + 8];
+	unsigned i, offset;
+	size_t len;
+	u32 expected;
+	crc32c_fn *fn;
+	enum crc32c_impl impl;
+
+	srand(0);
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	for (offset = 0; offset < 8; offset++)
+		for (len = 0; len <= CSUM_MAX_LEN; len += len < 64 ? 1 : 61) {
+			expected = crc32c_get_impl(CRC32C_BYTEWISE)(0x12345678, data + offset, len);
+			T_ASSERT_EQUAL(dm_bm_checksum(data + offset, len, 0x12345678), expected);
+
+			for (impl = 0; impl < CRC32C_NR_IMPLS; impl++) {
+				fn = crc32c_get_impl(impl);
+				if (fn)
+					T_ASSERT_EQUAL(fn(0x12345678, data + offset, len), expected);
+			}
+		}
+
+	// Whole blocks, and blocks less a csum field, are the common case.
+	for (len = BLOCK_SIZE - 4; len <= BLOCK_SIZE; len += 4) {
+		expected = crc32c_get_impl(CRC32C_BYTEWISE)(0, data, len);
+		for (impl = 0; impl < CRC32C_NR_IMPLS; impl++) {
+			fn = crc32c_get_impl(impl);
+			if (fn)
+				T_ASSERT_EQUAL(fn(0, data, len), expected);
+		}
+	}
+}
+
+//--------------------------------------------------------
+
+static void *create_ram_bm_()
+{
+	struct fixture *fix = create_fixture_(true);
+
+	fix->bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(fix->bm);
+
+	return fix;
+}
+
+static void *create_ram_mmap_bm_()
+{
+	return create_fixture_(true);
+}
+
+static void test_ram_disk_reads_zeroes(void *context)
+{
+	struct fixture *fix = context;
+	dm_block_t b;
+
+	for (b = 0; b < NR_BLOCKS; b++)
+		check_on_disk_(fix, b, 0);
+}
+
+static void test_ram_disk_out_of_range(void *context)
+{
+	struct fixture *fix = context;
+	uint8_t data[BLOCK_SIZE];
+
+	T_ASSERT_EQUAL(bdev_read(fix->bdev, data, BLOCK_SIZE, NR_BLOCKS * BLOCK_SIZE), -EIO);
+	T_ASSERT_EQUAL(bdev_write(fix->bdev, data, BLOCK_SIZE, (NR_BLOCKS - 1) * BLOCK_SIZE + 1), -EIO);
+}
+
+static void test_ram_disk_resize(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block_manager *bm;
+	uint8_t data[BLOCK_SIZE];
+	unsigned i;
+
+	dm_block_manager_destroy(fix->bm);
+	scribble_(fix, NR_BLOCKS - 1, 0xaa);
+
+	// Shrinking then growing again mustn't bring back the data that
+	// was cut off.
+	T_ASSERT(!ram_disk_resize(fix->bdev, (NR_BLOCKS - 1) * BLOCK_SIZE + 100));
+	T_ASSERT(!ram_disk_resize(fix->bdev, 2 * NR_BLOCKS * BLOCK_SIZE));
+
+	T_ASSERT(!bdev_read(fix->bdev, data, BLOCK_SIZE, (NR_BLOCKS - 1) * BLOCK_SIZE));
+	for (i = 0; i < BLOCK_SIZE; i++)
+		T_ASSERT_EQUAL(data[i], i < 100 ? 0xaa : 0);
+
+	fix->bm = bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(bm);
+	T_ASSERT_EQUAL(dm_bm_nr_blocks(bm), 2 * NR_BLOCKS);
+
+	fill_block_(bm, 2 * NR_BLOCKS - 1, 0x55);
+	T_ASSERT(!dm_bm_flush(bm));
+	check_on_disk_(fix, 2 * NR_BLOCKS - 1, 0x55);
+}
+
+static void test_ram_mmap_is_zero_copy(void *context)
+{
+	struct fixture *fix = context;
+	struct dm_block *blk;
+	void *first;
+
+	open_mmap_(fix);
+
+	T_ASSERT(!dm_bm_read_lock(fix->bm, 0, NULL, &blk));
+	first = dm_block_data(blk);
+	dm_bm_unlock(blk);
+
+	T_ASSERT(!dm_bm_read_lock(fix->bm, NR_BLOCKS - 1, NULL, &blk));
+	T_ASSERT(dm_block_data(blk) == first + (NR_BLOCKS - 1) * BLOCK_SIZE);
+	dm_bm_unlock(blk);
+}
+
+//--------------------------------------------------------
+
+#define SIM_LATENCY_NS 20000
+
+static void *create_sim_bm_()
+{
+	struct fixture *fix = create_fixture_(true);
+	struct sim_disk_config config = {
+		.latency = SIM_LATENCY_FIXED,
+		.latency_ns = SIM_LATENCY_NS,
+		.queue_depth = 4,
+	};
+
+	fix->bdev = sim_disk_create(fix->ram, &config);
+	T_ASSERT(fix->bdev);
+
+	fix->bm = dm_block_manager_create(fix->bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(fix->bm);
+
+	return fix;
+}
+
+static uint64_t now_ns_()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_sim_latency(void *context)
+{
+	struct fixture *fix = context;
+	uint64_t start = now_ns_();
+	dm_block_t b;
+
+	for (b = 0; b < 10; b++)
+		check_on_disk_(fix, b, 0);
+
+	T_ASSERT(now_ns_() - start >= 10 * SIM_LATENCY_NS);
+}
+
+static void test_sim_bandwidth(void *context)
+{
+	struct fixture *fix = context;
+	struct block_device *slow;
+	struct sim_disk_config config = {
+		.latency = SIM_LATENCY_FIXED,
+		.bandwidth = 4 * 1024 * 1024,
+	};
+	uint8_t data[BLOCK_SIZE];
+	uint64_t start;
+	dm_block_t b;
+
+	slow = sim_disk_create(fix->ram, &config);
+	T_ASSERT(slow);
+
+	// 8 blocks at 4M/s takes 8ms.
+	start = now_ns_();
+	for (b = 0; b < 8; b++)
+		T_ASSERT(!bdev_read(slow, data, BLOCK_SIZE, b * BLOCK_SIZE));
+	T_ASSERT(now_ns_() - start >= 8000000);
+
+	sim_disk_destroy(slow);
+}
+
+//--------------------------------------------------------
+
+#define SYNC_MARK ((dm_block_t) -1)
+#define MAX_RECORDED 64
+
+// Wraps a RAM disk, recording the order blocks are written and synced in.
+struct recorder {
+	struct block_device bdev;
+	struct block_device *inner;
+	unsigned nr;
+	dm_block_t log[MAX_RECORDED];
+};
+
+static struct recorder *to_recorder_(struct block_device *bdev)
+{
+	return (struct recorder *) bdev;
+}
+
+static void record_(struct recorder *rec, dm_block_t b)
+{
+	T_ASSERT(rec->nr < MAX_RECORDED);
+	rec->log[rec->nr++] = b;
+}
+
+static int recorder_read_(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	return bdev_read(to_recorder_(bdev)->inner, data, len, offset);
+}
+
+static int recorder_writev_(struct block_device *bdev, const struct iovec *iov,
+			    unsigned nr, off_t offset)
+{
+	unsigned i;
+	struct recorder *rec = to_recorder_(bdev);
+
+	for (i = 0; i < nr; i++)
+		record_(rec, offset / BLOCK_SIZE + i);
+
+	return bdev_writev(rec->inner, iov, nr, offset);
+}
+
+static int recorder_sync_(struct block_device *bdev)
+{
+	record_(to_recorder_(bdev), SYNC_MARK);
+	return 0;
+}
+
+static uint64_t recorder_size_(struct block_device *bdev)
+{
+	struct recorder *rec = to_recorder_(bdev);
+	return rec->inner->ops->size(rec->inner);
+}
+
+static const struct block_device_ops recorder_ops = {
+	.read = recorder_read_,
+	.writev = recorder_writev_,
+	.sync = recorder_sync_,
+	.size = recorder_size_,
+};
+
+static void test_barrier_order(void *context)
+{
+	static const dm_block_t expected[] = {3, 4, 9, SYNC_MARK, 0, SYNC_MARK};
+	struct recorder rec = {.bdev = {.ops = &recorder_ops, .fd = -1}};
+	struct dm_block_manager *bm;
+	unsigned i;
+
+	rec.inner = ram_disk_create((uint64_t) BLOCK_SIZE * NR_BLOCKS);
+	T_ASSERT(rec.inner);
+	bm = dm_block_manager_create(&rec.bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(bm);
+
+	// Nothing written, so no barrier.
+	T_ASSERT(!dm_bm_flush(bm));
+
+	// The data, then the superblock.
+	fill_block_(bm, 9, 9);
+	fill_block_(bm, 3, 3);
+	fill_block_(bm, 4, 4);
+	T_ASSERT(!dm_bm_flush(bm));
+
+	fill_block_(bm, 0, 1);
+	T_ASSERT(!dm_bm_flush(bm));
+
+	T_ASSERT_EQUAL(rec.nr, sizeof(expected) / sizeof(*expected));
+	for (i = 0; i < rec.nr; i++)
+		T_ASSERT_EQUAL(rec.log[i], expected[i]);
+
+	dm_block_manager_destroy(bm);
+	ram_disk_destroy(rec.inner);
+}
+
+#define NR_COMMITTERS 4
+
+/*
+ * Holds every barrier until each committer's block has been written, so
+ * the others are bound to be waiting on the first committer's barrier
+ * together.
+ */
+struct gate {
+	struct block_device bdev;
+	struct block_device *inner;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned nr_written;
+	unsigned nr_syncs;
+};
+
+static struct gate *to_gate_(struct block_device *bdev)
+{
+	return (struct gate *) bdev;
+}
+
+static int gate_read_(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	return bdev_read(to_gate_(bdev)->inner, data, len, offset);
+}
+
+static int gate_writev_(struct block_device *bdev, const struct iovec *iov,
+			unsigned nr, off_t offset)
+{
+	int r;
+	struct gate *g = to_gate_(bdev);
+
+	r = bdev_writev(g->inner, iov, nr, offset);
+
+	pthread_mutex_lock(&g->lock);
+	g->nr_written += nr;
+	pthread_cond_broadcast(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+
+	return r;
+}
+
+static int gate_sync_(struct block_device *bdev)
+{
+	struct gate *g = to_gate_(bdev);
+
+	pthread_mutex_lock(&g->lock);
+	g->nr_syncs++;
+	pthread_cond_broadcast(&g->cond);
+	while (g->nr_written < NR_COMMITTERS)
+		pthread_cond_wait(&g->cond, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+
+	return bdev_sync(g->inner);
+}
+
+static uint64_t gate_size_(struct block_device *bdev)
+{
+	struct gate *g = to_gate_(bdev);
+	return g->inner->ops->size(g->inner);
+}
+
+static const struct block_device_ops gate_ops = {
+	.read = gate_read_,
+	.writev = gate_writev_,
+	.sync = gate_sync_,
+	.size = gate_size_,
+};
+
+struct committer {
+	struct dm_block_manager *bm;
+	dm_block_t b;
+
+	// The followers all dirty their blocks before any of them flushes.
+	pthread_barrier_t *dirtied;
+};
+
+static void *committer_(void *context)
+{
+	struct committer *c = context;
+
+	fill_block_(c->bm, c->b, c->b + 1);
+	if (c->dirtied)
+		pthread_barrier_wait(c->dirtied);
+	T_ASSERT(!dm_bm_flush(c->bm));
+
+	return NULL;
+}
+
+/*
+ * The first committer's barrier starts before the others have written
+ * anything, and is held until they have.  The first follower to flush
+ * writes every follower's block, and the rest find nothing left to
+ * write, so whichever of them issues the next barrier covers them all.
+ */
+static void test_group_commit(void *context)
+{
+	struct gate g = {.bdev = {.ops = &gate_ops, .fd = -1}, .nr_written = 0, .nr_syncs = 0};
+	struct dm_block_manager *bm;
+	struct dm_bm_stats stats;
+	struct committer cs[NR_COMMITTERS];
+	pthread_t threads[NR_COMMITTERS];
+	pthread_barrier_t dirtied;
+	unsigned i;
+
+	pthread_mutex_init(&g.lock, NULL);
+	pthread_cond_init(&g.cond, NULL);
+	T_ASSERT(!pthread_barrier_init(&dirtied, NULL, NR_COMMITTERS - 1));
+	g.inner = ram_disk_create((uint64_t) BLOCK_SIZE * NR_BLOCKS);
+	T_ASSERT(g.inner);
+	bm = dm_block_manager_create(&g.bdev, BLOCK_SIZE, MAX_HELD, CACHE_SIZE);
+	T_ASSERT(bm);
+
+	for (i = 0; i < NR_COMMITTERS; i++) {
+		cs[i].bm = bm;
+		cs[i].b = i;
+		cs[i].dirtied = i ? &dirtied : NULL;
+	}
+
+	T_ASSERT(!pthread_create(threads, NULL, committer_, cs));
+	pthread_mutex_lock(&g.lock);
+	while (!g.nr_syncs)
+		pthread_cond_wait(&g.cond, &g.lock);
+	pthread_mutex_unlock(&g.lock);
+
+	for (i = 1; i < NR_COMMITTERS; i++)
+		T_ASSERT(!pthread_create(threads + i, NULL, committer_, cs + i));
+	for (i = 0; i < NR_COMMITTERS; i++)
+		T_ASSERT(!pthread_join(threads[i], NULL));
+
+	// The leader's barrier, and one for everyone else.
+	dm_bm_get_stats(bm, &stats);
+	T_ASSERT_EQUAL(stats.flushes, NR_COMMITTERS);
+	T_ASSERT_EQUAL(stats.barriers, 2);
+
+	for (i = 0; i < NR_COMMITTERS; i++)
+		check_block_(bm, i, i + 1);
+
+	dm_block_manager_destroy(bm);
+	ram_disk_destroy(g.inner);
+	pthread_barrier_destroy(&dirtied);
+	pthread_cond_destroy(&g.cond);
+	pthread_mutex_destroy(&g.lock);
+}
+
+//--------------------------------------------------------
+
+#define BENCH_MAX_RESIDENT 8192
+#define BENCH_NR_LOCKS 1000000
+
+static double now_()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Average ns per lock/unlock pair with nr_resident blocks in the cache.
+static double time_lock_unlock_(unsigned nr_resident)
+{
+	unsigned i;
+	double start, elapsed;
+	struct block_device bdev;
+	struct dm_block_manager *bm;
+	struct dm_block *blk;
+
+	block_device_init_fd(&bdev, create_block_file(BLOCK_SIZE, nr_resident));
+
+	bm = dm_block_manager_create(&bdev, BLOCK_SIZE, MAX_HELD, nr_resident);
+	T_ASSERT(bm);
+
+	for (i = 0; i < nr_resident; i++)
+		check_block_(bm, i, 0);
+
+	start = now_();
+	for (i = 0; i < BENCH_NR_LOCKS; i++) {
+		T_ASSERT(!dm_bm_read_lock(bm, rand() % nr_resident, NULL, &blk));
+		dm_bm_unlock(blk);
+	}
+	elapsed = now_() - start;
+
+	dm_block_manager_destroy(bm);
+	close(bdev.fd);
+
+	return elapsed * 1000000000.0 / BENCH_NR_LOCKS;
+}
+
+static void bench_lookup(void *context)
+{
+	unsigned nr_resident;
+
+	for (nr_resident = 16; nr_resident <= BENCH_MAX_RESIDENT; nr_resident *= 8)
+		fprintf(stderr, "    %5u resident: %6.1f ns per lock/unlock\n",
+			nr_resident, time_lock_unlock_(nr_resident));
+}
+
+#define BENCH_SCAN_LEN 1024
+
+// Average us per block for an ascending scan of a slow device.
+static double time_scan_(unsigned readahead)
+{
+	unsigned i;
+	double start, elapsed;
+	struct block_device *ram, *sim;
+	struct dm_block_manager *bm;
+	struct sim_disk_config config = {
+		.latency = SIM_LATENCY_TAIL,
+		.latency_ns = 50000,
+		.max_latency_ns = 5000000,
+		.tail_shape = 1.5,
+		.queue_depth = 16,
+		.bandwidth = 200 * 1024 * 1024,
+	};
+
+	ram = ram_disk_create((uint64_t) BLOCK_SIZE * BENCH_SCAN_LEN);
+	T_ASSERT(ram);
+	sim = sim_disk_create(ram, &config);
+	T_ASSERT(sim);
+
+	bm = dm_block_manager_create(sim, BLOCK_SIZE, MAX_HELD, 256);
+	T_ASSERT(bm);
+	dm_bm_set_readahead(bm, readahead);
+
+	start = now_();
+	for (i = 0; i < BENCH_SCAN_LEN; i++)
+		check_block_(bm, i, 0);
+	elapsed = now_() - start;
+
+	dm_block_manager_destroy(bm);
+	sim_disk_destroy(sim);
+	ram_disk_destroy(ram);
+
+	return elapsed * 1000000.0 / BENCH_SCAN_LEN;
+}
+
+static void bench_readahead(void *context)
+{
+	unsigned readahead;
+
+	for (readahead = 0; readahead <= 64; readahead = readahead ? readahead * 4 : 4)
+		fprintf(stderr, "    readahead %2u: %6.1f us per block\n",
+			readahead, time_scan_(readahead));
+}
+
+#define BENCH_FLUSH_BLOCKS 4096
+
+// Average us per block to flush a transaction that dirtied every block.
+static double time_flush_(unsigned nr_threads)
+{
+	unsigned i;
+	double start, elapsed;
+	struct block_device *ram;
+	struct dm_block_manager *bm;
+	struct dm_block *blk;
+
+	ram = ram_disk_create((uint64_t) BLOCK_SIZE * BENCH_FLUSH_BLOCKS);
+	T_ASSERT(ram);
+	bm = dm_block_manager_create(ram, BLOCK_SIZE, MAX_HELD, BENCH_FLUSH_BLOCKS);
+	T_ASSERT(bm);
+	dm_bm_set_flush_threads(bm, nr_threads);
+
+	for (i = 0; i < BENCH_FLUSH_BLOCKS; i++) {
+		T_ASSERT(!dm_bm_write_lock_zero(bm, i, &stamping_validator_, &blk));
+		dm_bm_unlock(blk);
+	}
+
+	start = now_();
+	T_ASSERT(!dm_bm_flush(bm));
+	elapsed = now_() - start;
+
+	dm_block_manager_destroy(bm);
+	ram_disk_destroy(ram);
+
+	return elapsed * 1000000.0 / BENCH_FLUSH_BLOCKS;
+}
+
+static void bench_flush(void *context)
+{
+	unsigned nr_threads;
+
+	for (nr_threads = 0; nr_threads <= 4; nr_threads += 2)
+		fprintf(stderr, "    %u threads: %5.2f us per block\n",
+			nr_threads, time_flush_(nr_threads));
+}
+
+#define BENCH_NR_CHECKSUMS 100000
+
+static void bench_checksum(void *context)
+{
+	static const char *names[] = {"bytewise", "slice-by-8", "sse4.2", "pclmul"};
+	static uint8_t data[BLOCK_SIZE];
+	enum crc32c_impl impl;
+	crc32c_fn *fn;
+	double start, elapsed;
+	unsigned i;
+	u32 crc = 0;
+
+	for (impl = 0; impl < CRC32C_NR_IMPLS; impl++) {
+		fn = crc32c_get_impl(impl);
+		if (!fn) {
+			fprintf(stderr, "    %10s: not supported\n", names[impl]);
+			continue;
+		}
+
+		start = now_();
+		for (i = 0; i < BENCH_NR_CHECKSUMS; i++)
+			crc = fn(crc, data, BLOCK_SIZE - 4);
+		elapsed = now_() - start;
+
+		fprintf(stderr, "    %10s: %7.1f ns per block\n", names[impl],
+			elapsed * 1000000000.0 / BENCH_NR_CHECKSUMS);
+	}
+}
+
+//--------------------------------------------------------
+
+#define T(path, desc, fn) register_test(ts, "/block-manager/" path, desc, fn)
+
+static struct test_suite *cache_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("cache/read-after-write", "written data can be read back", test_read_after_write);
+	T("cache/resident-across-unlock", "unlocked blocks stay cached until recycled", test_resident_across_unlock);
+	T("cache/held-not-recycled", "held blocks are never recycled", test_held_blocks_are_not_recycled);
+	T("cache/write-back", "dirty blocks are written by flush or recycling", test_write_back);
+	T("cache/flush-runs", "flush writes scattered dirty blocks correctly", test_flush_runs);
+	T("prefetch/read", "prefetched blocks read back correctly", test_prefetch);
+	T("validate/once", "clean cached blocks aren't checked again", test_validated_once);
+	T("validate/failure-not-cached", "blocks that fail their check aren't cached", test_failed_check_not_cached);
+	T("validate/failed-prefetch", "prefetched blocks that fail their check aren't cached", test_failed_prefetch_check);
+	T("stats/counters", "the stats count what the bm does", test_stats);
+	T("stats/threads", "every thread's activity is counted", test_stats_from_other_threads);
+	T("readahead/ascending", "ascending locks are read ahead", test_readahead);
+	T("readahead/random", "random locks aren't read ahead", test_no_readahead_for_random_locks);
+	T("locking/max-held", "threads can't hold more than max_held_per_thread blocks", test_max_held);
+	T("locking/concurrent", "readers never see a partially written block", test_concurrent_readers_and_writer);
+	T("prefetch/then-write", "a prefetched block may be write locked", test_prefetch_then_write);
+	T("classes/stats", "hits and misses are counted by block class", test_class_stats);
+	T("classes/eviction", "internal nodes are kept in preference to leaves", test_internal_nodes_outlive_leaves);
+	T("flush/parallel-prepare", "blocks are prepared by the flush threads", test_parallel_prepare);
+	T("flush/locked", "flush writes read locked blocks and refuses our write locks", test_flush_locked);
+	T("try-lock/miss", "try locks of uncached blocks fail and prefetch", test_try_lock_miss);
+	T("try-lock/failed-prefetch", "a reread block can be try locked", test_try_lock_after_failed_prefetch);
+	T("try-lock/write-locked", "try locks of write locked blocks fail", test_try_lock_write_locked);
+	T("move/clean", "clean cached blocks can be moved", test_move);
+	T("move/refused", "blocks that can't be moved are left alone", test_move_refused);
+
+	return ts;
+}
+
+static struct test_suite *direct_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_direct_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("direct/aligned", "block buffers are aligned for O_DIRECT", test_direct_buffers_aligned);
+	T("direct/read-after-write", "written data can be read back", test_read_after_write);
+	T("direct/write-back", "dirty blocks are written by flush or recycling", test_write_back);
+	T("direct/prefetch", "prefetched blocks read back correctly", test_prefetch);
+
+	return ts;
+}
+
+static struct test_suite *mmap_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_mmap_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("mmap/read", "blocks are read through the mapping", test_mmap_read);
+	T("mmap/read-only", "write locks fail with -EPERM", test_mmap_is_read_only);
+	T("mmap/out-of-range", "locks past the end fail with -EINVAL", test_mmap_out_of_range);
+	T("mmap/validate-once", "each block is validated once", test_mmap_validates_once);
+
+	return ts;
+}
+
+static struct test_suite *ram_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_ram_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("ram/reads-zeroes", "a new RAM disk reads back as zeroes", test_ram_disk_reads_zeroes);
+	T("ram/out-of-range", "ios past the end fail with -EIO", test_ram_disk_out_of_range);
+	T("ram/read-after-write", "written data can be read back", test_read_after_write);
+	T("ram/write-back", "dirty blocks are written by flush or recycling", test_write_back);
+	T("ram/flush-runs", "flush writes scattered dirty blocks correctly", test_flush_runs);
+	T("ram/prefetch", "prefetching without an io engine is harmless", test_prefetch);
+	T("ram/resize", "a RAM disk can grow", test_ram_disk_resize);
+
+	return ts;
+}
+
+static struct test_suite *ram_mmap_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_ram_mmap_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("ram/mmap/read", "blocks are read straight from the RAM disk", test_mmap_read);
+	T("ram/mmap/zero-copy", "block data points into the RAM disk", test_ram_mmap_is_zero_copy);
+
+	return ts;
+}
+
+static struct test_suite *sim_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_sim_bm_, destroy_bm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("sim/latency", "ios take at least the configured latency", test_sim_latency);
+	T("sim/bandwidth", "ios are limited to the configured bandwidth", test_sim_bandwidth);
+	T("sim/read-after-write", "written data can be read back", test_read_after_write);
+	T("sim/write-back", "dirty blocks are written by flush or recycling", test_write_back);
+	T("sim/flush-runs", "flush writes scattered dirty blocks correctly", test_flush_runs);
+	T("sim/prefetch", "prefetched blocks read back correctly", test_prefetch);
+	T("sim/readahead", "ascending locks are read ahead", test_readahead);
+
+	return ts;
+}
+
+static struct test_suite *uring_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_uring_, destroy_engine_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("io-engine/uring/write-then-read", "ios complete with the right data", test_engine_write_then_read);
+	T("io-engine/uring/short-read", "short transfers are reported as -EIO", test_engine_short_read);
+
+	return ts;
+}
+
+static struct test_suite *thread_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_threads_, destroy_engine_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("io-engine/threads/write-then-read", "ios complete with the right data", test_engine_write_then_read);
+	T("io-engine/threads/short-read", "short transfers are reported as -EIO", test_engine_short_read);
+
+	return ts;
+}
+
+static struct test_suite *barrier_tests(void)
+{
+	struct test_suite *ts = test_suite_create(NULL, NULL);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("barrier/order", "flush writes the dirty blocks, then syncs", test_barrier_order);
+	T("barrier/group-commit", "concurrent flushes share barriers", test_group_commit);
+
+	return ts;
+}
+
+static struct test_suite *checksum_tests(void)
+{
+	struct test_suite *ts = test_suite_create(NULL, NULL);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("checksum/known-value", "dm_bm_checksum is crc32c", test_checksum_known_value);
+	T("checksum/impls-agree", "every crc32c implementation gives the same result", test_checksum_impls_agree);
+
+	return ts;
+}
+
+static struct test_suite *bench_tests(void)
+{
+	struct test_suite *ts = test_suite_create(NULL, NULL);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("bench/lookup", "lock/unlock cost as the cache fills", bench_lookup);
+	T("bench/checksum", "cost of checksumming a block", bench_checksum);
+	T("bench/readahead", "scanning a slow device with readahead", bench_readahead);
+	T("bench/flush", "flushing with parallel prepare_for_write", bench_flush);
+
+	return ts;
+}
+
+//--------------------------------------------------------
+
+void block_manager_tests(struct list_head *suites)
+{
+	list_add(&cache_tests()->list, suites);
+	list_add(&direct_tests()->list, suites);
+	list_add(&mmap_tests()->list, suites);
+	list_add(&ram_tests()->list, suites);
+	list_add(&ram_mmap_tests()->list, suites);
+	list_add(&sim_tests()->list, suites);
+	list_add(&uring_tests()->list, suites);
+	list_add(&thread_tests()->list, suites);
+	list_add(&barrier_tests()->list, suites);
+	list_add(&checksum_tests()->list, suites);
+
+	// The benchmarks are slow and print timings, so they only run
+	// when asked for.
+	if (getenv("UNIT_TEST_BENCH"))
+		list_add(&bench_tests()->list, suites);
+}
+
+//--------------------------------------------------------
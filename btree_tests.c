@@ -10,12 +10,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 // FIXME: do endian conversions
  
 //--------------------------------------------------------
 
 #define BLOCK_SIZE 4096
+#define CACHE_SIZE 1024
 
 static unsigned rnd(unsigned end)
 {
@@ -35,19 +37,17 @@ struct fixture {
 	struct dm_block_validator *validator;
 };
 
-static FILE *create_block_file_(unsigned block_size, dm_block_t nr_blocks)
+static int create_block_file_(unsigned block_size, dm_block_t nr_blocks)
 {
-	unsigned i;
-	FILE *f = tmpfile();
-	T_ASSERT(f);
+	char path[] = "/tmp/unit-test-XXXXXX";
+	int fd = mkstemp(path);
+	T_ASSERT(fd >= 0);
+	unlink(path);
 
-	uint8_t data[block_size];
-	memset(data, 0, sizeof(data));
-	for (i = 0; i < nr_blocks; i++)
-		fwrite(data, block_size, 1, f);
-	rewind(f);
+	// The file reads back as zeroes.
+	T_ASSERT(!ftruncate(fd, (off_t) block_size * nr_blocks));
 
-	return f;
+	return fd;
 }
 
 static void *create_tm_()
@@ -56,9 +56,9 @@ static void *create_tm_()
 	T_ASSERT(fix);
 
 	fix->nr_blocks = 10240;
-	fix->bdev.file = create_block_file_(BLOCK_SIZE, fix->nr_blocks);
+	block_device_init_fd(&fix->bdev, create_block_file_(BLOCK_SIZE, fix->nr_blocks));
 
-	fix->bm = dm_block_manager_create(&fix->bdev, BLOCK_SIZE, 10);
+	fix->bm = dm_block_manager_create(&fix->bdev, BLOCK_SIZE, 10, CACHE_SIZE);
 	T_ASSERT(fix->bm);
 
 	fix->sm = dm_sm_core_create(fix->nr_blocks);
@@ -84,7 +84,7 @@ static void destroy_tm_(void *context)
 	dm_tm_destroy(fix->tm);
 	dm_sm_destroy(fix->sm);
 	dm_block_manager_destroy(fix->bm);
-	fclose(fix->bdev.file);
+	close(fix->bdev.fd);
 	free(fix);
 }
 
@@ -2,10 +2,24 @@
 #define compat_bitops_h_INCLUDED
 
 #include <stdbool.h>
+#include <stdint.h>
 
-static inline bool test_bit_le(unsigned bit, void *mem) {return true;}
-static inline void __set_bit_le(unsigned bit, void *mem) {}
-static inline void __clear_bit_le(unsigned bit, void *mem) {}
+// Little endian bit numbering, which on the hosts we build for is the
+// native one.
+static inline bool test_bit_le(unsigned bit, void *mem)
+{
+	return (((uint8_t *) mem)[bit / 8] >> (bit % 8)) & 1;
+}
+
+static inline void __set_bit_le(unsigned bit, void *mem)
+{
+	((uint8_t *) mem)[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void __clear_bit_le(unsigned bit, void *mem)
+{
+	((uint8_t *) mem)[bit / 8] &= ~(1 << (bit % 8));
+}
 
 #endif
 
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include "block-device.h"
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*----------------------------------------------------------------
+ * Files
+ *--------------------------------------------------------------*/
+
+static int fd_read_(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	ssize_t r = pread(bdev->fd, data, len, offset);
+	return io_result(r < 0 ? -errno : r, len);
+}
+
+static int fd_writev_(struct block_device *bdev, const struct iovec *iov, unsigned nr, off_t offset)
+{
+	unsigned i;
+	size_t len = 0;
+	ssize_t r;
+
+	for (i = 0; i < nr; i++)
+		len += iov[i].iov_len;
+
+	r = pwritev(bdev->fd, iov, nr, offset);
+	return io_result(r < 0 ? -errno : r, len);
+}
+
+static int fd_sync_(struct block_device *bdev)
+{
+	return fdatasync(bdev->fd) ? -errno : 0;
+}
+
+// st_size is 0 for a block device, so those are asked directly.
+static uint64_t fd_size_(struct block_device *bdev)
+{
+	uint64_t size;
+	struct stat info;
+
+	if (fstat(bdev->fd, &info))
+		return 0;
+
+	if (S_ISBLK(info.st_mode))
+		return ioctl(bdev->fd, BLKGETSIZE64, &size) ? 0 : size;
+
+	return info.st_size;
+}
+
+static void *fd_map_(struct block_device *bdev, size_t len)
+{
+	void *mem = mmap(NULL, len, PROT_READ, MAP_SHARED, bdev->fd, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void fd_unmap_(struct block_device *bdev, void *mem, size_t len)
+{
+	munmap(mem, len);
+}
+
+static struct io_engine *fd_create_engine_(struct block_device *bdev, unsigned queue_depth)
+{
+	return create_async_io_engine(queue_depth);
+}
+
+static const struct block_device_ops fd_ops = {
+	.read = fd_read_,
+	.writev = fd_writev_,
+	.sync = fd_sync_,
+	.size = fd_size_,
+	.map = fd_map_,
+	.unmap = fd_unmap_,
+	.create_engine = fd_create_engine_,
+};
+
+void block_device_init_fd(struct block_device *bdev, int fd)
+{
+	bdev->ops = &fd_ops;
+	bdev->fd = fd;
+}
+
+/*----------------------------------------------------------------
+ * RAM disks
+ *--------------------------------------------------------------*/
+
+struct ram_disk {
+	struct block_device bdev;
+
+	void *mem;
+	size_t len;
+};
+
+static struct ram_disk *to_ram(struct block_device *bdev)
+{
+	return (struct ram_disk *) bdev;
+}
+
+static int ram_read_(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	struct ram_disk *rd = to_ram(bdev);
+
+	if (offset < 0 || offset + len > rd->len)
+		return -EIO;
+
+	memcpy(data, rd->mem + offset, len);
+	return 0;
+}
+
+static int ram_writev_(struct block_device *bdev, const struct iovec *iov, unsigned nr, off_t offset)
+{
+	unsigned i;
+	struct ram_disk *rd = to_ram(bdev);
+
+	for (i = 0; i < nr; i++) {
+		if (offset < 0 || offset + iov[i].iov_len > rd->len)
+			return -EIO;
+
+		memcpy(rd->mem + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+// Nothing survives a crash anyway.
+static int ram_sync_(struct block_device *bdev)
+{
+	return 0;
+}
+
+static uint64_t ram_size_(struct block_device *bdev)
+{
+	return to_ram(bdev)->len;
+}
+
+static void *ram_map_(struct block_device *bdev, size_t len)
+{
+	struct ram_disk *rd = to_ram(bdev);
+	return len <= rd->len ? rd->mem : NULL;
+}
+
+static void ram_unmap_(struct block_device *bdev, void *mem, size_t len)
+{
+}
+
+static const struct block_device_ops ram_ops = {
+	.read = ram_read_,
+	.writev = ram_writev_,
+	.sync = ram_sync_,
+	.size = ram_size_,
+	.map = ram_map_,
+	.unmap = ram_unmap_,
+};
+
+struct block_device *ram_disk_create(uint64_t nr_bytes)
+{
+	struct ram_disk *rd = malloc(sizeof(*rd));
+
+	if (!rd)
+		return NULL;
+
+	rd->bdev.ops = &ram_ops;
+	rd->bdev.fd = -1;
+
+	// mmap rather than malloc, so untouched pages cost nothing.  The
+	// length is never 0, which mmap won't accept.
+	rd->len = nr_bytes;
+	rd->mem = mmap(NULL, rd->len ? rd->len : 1, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (rd->mem == MAP_FAILED) {
+		free(rd);
+		return NULL;
+	}
+
+	return &rd->bdev;
+}
+
+int ram_disk_resize(struct block_device *bdev, uint64_t nr_bytes)
+{
+	struct ram_disk *rd = to_ram(bdev);
+	size_t old_len = rd->len ? rd->len : 1;
+	size_t end, page_size = sysconf(_SC_PAGESIZE);
+	void *mem;
+
+	mem = mremap(rd->mem, old_len, nr_bytes ? nr_bytes : 1, MREMAP_MAYMOVE);
+	if (mem == MAP_FAILED)
+		return -ENOMEM;
+
+	// Growing maps fresh zero pages, but the tail of the old last page
+	// may still hold data from before an earlier shrink.
+	if (nr_bytes > rd->len) {
+		end = (rd->len + page_size - 1) & ~(page_size - 1);
+		if (end > nr_bytes)
+			end = nr_bytes;
+		memset(mem + rd->len, 0, end - rd->len);
+	}
+
+	rd->mem = mem;
+	rd->len = nr_bytes;
+	return 0;
+}
+
+void ram_disk_destroy(struct block_device *bdev)
+{
+	struct ram_disk *rd = to_ram(bdev);
+
+	munmap(rd->mem, rd->len ? rd->len : 1);
+	free(rd);
+}
+
+/*----------------------------------------------------------------*/
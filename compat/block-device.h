@@ -0,0 +1,92 @@
+#ifndef compat_block_device_h_INCLUDED
+#define compat_block_device_h_INCLUDED
+
+#include "io-engine.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * The device the block manager reads and writes.  Either a file (or
+ * real block device) opened by the caller, or a RAM disk.
+ */
+struct block_device;
+
+struct block_device_ops {
+	// These return 0, or a -ve errno.  Short transfers are -EIO.
+	int (*read)(struct block_device *bdev, void *data, size_t len, off_t offset);
+	int (*writev)(struct block_device *bdev, const struct iovec *iov, unsigned nr, off_t offset);
+
+	// A barrier.  Returns once everything written so far is durable.
+	int (*sync)(struct block_device *bdev);
+
+	// In bytes.
+	uint64_t (*size)(struct block_device *bdev);
+
+	// Read only access to the first @len bytes, for mmap mode.  NULL on failure.
+	void *(*map)(struct block_device *bdev, size_t len);
+	void (*unmap)(struct block_device *bdev, void *mem, size_t len);
+
+	// An engine for asynchronous reads, which are issued with the
+	// bdev's fd.  NULL if async io isn't worth it, in which case the bm
+	// doesn't prefetch.
+	struct io_engine *(*create_engine)(struct block_device *bdev, unsigned queue_depth);
+};
+
+struct block_device {
+	const struct block_device_ops *ops;
+
+	// -1 if the device isn't a file.
+	int fd;
+};
+
+/*
+ * Uses an fd opened for read/write.  Blocks are read and written with
+ * pread/pwrite, so the offset of the fd doesn't matter.  The caller
+ * still owns the fd.
+ */
+void block_device_init_fd(struct block_device *bdev, int fd);
+
+/*
+ * A RAM disk is one contiguous buffer, read and written with memcpy.
+ * mmap mode references it directly, with no copying at all.  It reads
+ * back as zeroes, and memory is only used once blocks are touched, so
+ * very large disks are cheap.
+ *
+ * Don't resize a RAM disk while a bm is using it.
+ */
+struct block_device *ram_disk_create(uint64_t nr_bytes);
+int ram_disk_resize(struct block_device *bdev, uint64_t nr_bytes);
+void ram_disk_destroy(struct block_device *bdev);
+
+/*----------------------------------------------------------------*/
+
+static inline int bdev_read(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	return bdev->ops->read(bdev, data, len, offset);
+}
+
+static inline int bdev_writev(struct block_device *bdev, const struct iovec *iov,
+			      unsigned nr, off_t offset)
+{
+	return bdev->ops->writev(bdev, iov, nr, offset);
+}
+
+static inline int bdev_sync(struct block_device *bdev)
+{
+	return bdev->ops->sync(bdev);
+}
+
+static inline int bdev_write(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	struct iovec iov = {.iov_base = data, .iov_len = len};
+	return bdev_writev(bdev, &iov, 1, offset);
+}
+
+/*----------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef compat_crc32c_h_INCLUDED
+#define compat_crc32c_h_INCLUDED
+
+#include "types.h"
+
+#include <stddef.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * CRC32C (Castagnoli).  These update @crc with @len bytes of @data; there's
+ * no pre or post inversion, the caller chooses the seed.
+ */
+typedef u32 crc32c_fn(u32 crc, const void *data, size_t len);
+
+/*
+ * Uses the fastest implementation the cpu supports.
+ */
+u32 crc32c(u32 crc, const void *data, size_t len);
+
+/*
+ * The individual implementations, so they can be checked against each
+ * other.  They all give identical results.
+ */
+enum crc32c_impl {
+	CRC32C_BYTEWISE,
+	CRC32C_SLICE_BY_8,
+	CRC32C_SSE42,		// the crc32 instruction
+	CRC32C_PCLMUL,		// crc32 on three streams, combined with pclmulqdq
+
+	CRC32C_NR_IMPLS
+};
+
+// NULL if the cpu doesn't support @impl.
+crc32c_fn *crc32c_get_impl(enum crc32c_impl impl);
+
+/*----------------------------------------------------------------*/
+
+#endif
@@ -23,10 +23,14 @@ static inline sector_t dm_sector_div_up(sector_t n, sector_t d)
 	return (n + (d - 1)) / d;
 }
 
-static inline uint64_t do_div(uint64_t n, uint64_t d)
-{
-	return n / d;
-}
+/*
+ * Divides @n by @d in place, and returns the remainder.
+ */
+#define do_div(n, d) ({				\
+	uint32_t __rem = (n) % (d);		\
+	(n) /= (d);				\
+	__rem;					\
+})
 
 #define __cmp(x, y, op) ((x) op (y) ? (x) : (y))
 
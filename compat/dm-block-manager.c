@@ -1,31 +1,240 @@
 #include "dm-block-manager.h"
 #include "framework.h"
+#include "device-mapper.h"
+#include "cmp.h"
+#include "hash.h"
+#include "io-engine.h"
+#include "crc32c.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 
 struct dm_block {
 	struct dm_block_manager *bm;
+
+	// On held_blocks while locked, on the lru list otherwise.
 	struct list_head list;
 
-	// -ve for write lock, 0 unlocked, +ve for shared read locks
+	// -ve for write lock, 0 unlocked, +ve for shared read locks.  A
+	// block that's being read in is write locked by the reading thread.
 	int lock_count;
+	pthread_t writer;
 	dm_block_t b;
 	void *data;
 
+	// Modified since it was last written.
+	bool dirty;
+
+	// A prefetch read is in flight.
+	bool io_pending;
+	int io_error;
+
+	// Being written back by clean_victim_(), which has it write locked.
+	bool writing;
+
+	// Read by a prefetch and not locked since.
+	bool prefetched;
+
+	enum dm_block_class class;
+
+	// How many more times the block may reach the tail of the lru
+	// before it's recycled.  Reset from class_weights_ on each use.
+	unsigned credits;
+
+	// The data has passed v's check, or was written by us, so later
+	// locks don't check it again.  Prefetched blocks aren't validated
+	// until a lock tells us which validator they have.
+	bool validated;
+
 	struct dm_block_validator *v;
 };
 
+/*
+ * Maps block numbers to resident blocks.  Open addressing with linear
+ * probing; the table is kept at most half full and doubles when it gets
+ * fuller than that.
+ */
+struct block_index {
+	unsigned bits;
+	unsigned nr_entries;
+	struct dm_block **slots;
+};
+
+/*
+ * Every block the bm will ever need is allocated when it's created:
+ * one array of descriptors, and one mapping that's carved into their
+ * buffers.  So memory use is fixed up front, the lock paths never call
+ * the allocator, and every buffer is aligned to the page size (or
+ * better).  That alignment is what O_DIRECT needs.  Hugepages are used
+ * if any are reserved.
+ *
+ * Blocks that aren't caching anything sit on the free list.  Once
+ * taken, a block is normally recycled through the lru rather than
+ * returned, and it keeps its buffer for life.
+ */
+struct block_pool {
+	struct dm_block *blocks;
+
+	// NULL in mmap mode, where the blocks point into the device mapping.
+	void *mem;
+	size_t len;
+
+	struct list_head free;
+};
+
+/*
+ * Each thread that uses a bm gets one of these.  Only the owning thread
+ * writes to it, so the counters need no locking; dm_bm_get_stats() adds
+ * them up, tolerating counts that are a moment out of date.
+ */
+struct thread_state {
+	struct list_head list;
+	struct dm_block_manager *bm;
+
+	unsigned nr_held;
+	struct dm_bm_stats stats;
+
+	// Readahead stream detection, see readahead_().
+	dm_block_t last_locked;
+	unsigned stream_len;
+	dm_block_t readahead_end;
+};
+
+/*
+ * Threads that run prepare_for_write on the dirty blocks at flush.
+ * They claim PREPARE_CHUNK blocks of the sorted batch at a time.
+ */
+struct flush_workers {
+	pthread_mutex_t lock;
+
+	// Signalled when a flush starts, or the workers should stop.
+	pthread_cond_t work;
+
+	// Signalled when a chunk is prepared, or a worker goes idle.
+	pthread_cond_t done;
+
+	unsigned nr_threads;
+	pthread_t *threads;
+	bool stopping;
+
+	// The batch size of the flush in progress, 0 between flushes.
+	unsigned nr;
+
+	// The next block to claim, and the chunks that are ready.  Both
+	// are accessed with atomics.
+	unsigned next;
+	uint8_t *ready;
+
+	// Workers that might still claim a chunk of this flush.
+	unsigned nr_busy;
+};
+
+// A completion gathered by reap_().
+struct reaped_io {
+	struct dm_block *blk;
+	int io_error;
+};
+
+/*
+ * Blocks stay resident after their last unlock, up to a maximum of
+ * cache_size blocks.  Unlocked blocks sit on the lru list, most recently
+ * used at the front.  When the cache is full the least recently used
+ * block is recycled, though blocks of the classes in class_weights_
+ * get a few more trips round the list first.
+ *
+ * Writes are deferred until either dm_bm_flush() or the block is
+ * recycled, so a block that's locked and modified many times within a
+ * transaction only gets written once.  Flush sorts the dirty blocks and
+ * writes runs of adjacent ones with a single writev, then syncs the
+ * device.
+ *
+ * Prefetches are read asynchronously into the cache by the io engine.
+ * A lock on a block that's still being read waits for just that io.
+ *
+ * A bm created by dm_block_manager_create_mmap() has no io engine and
+ * no block buffers.  Its blocks point straight into a read only
+ * mapping of the device, and only the descriptors are cached.
+ *
+ * Everything above is protected by @lock, but no io is done while
+ * holding it.  A block that's being read, or written back so it can be
+ * recycled, is write locked meanwhile, and blocks being written by a
+ * flush are read locked, so only threads that want those blocks wait
+ * for the io.  Threads waiting for a block lock sleep on @unlocked,
+ * which is broadcast whenever a block becomes unheld or an io finishes.
+ */
 struct dm_block_manager {
+	pthread_mutex_t lock;
+	pthread_cond_t unlocked;
+
+	// Per thread state, see struct thread_state.  @threads and the
+	// stats of threads that have exited are protected by @stats_lock.
+	unsigned max_held_per_thread;
+	pthread_key_t thread_key;
+	pthread_mutex_t stats_lock;
+	struct list_head threads;
+	struct dm_bm_stats exited_stats;
+
+	// What the counters were at the last dm_bm_reset_stats().
+	struct dm_bm_stats base_stats;
+
 	unsigned block_size;
+	unsigned cache_size;
+	unsigned nr_cached;
+
+	struct io_engine *engine;
+	unsigned nr_in_flight;
+
+	// The engine isn't thread safe, so one thread at a time waits on
+	// it, with @lock dropped.  It gathers the completions in @reaped
+	// and applies them once it has @lock again.
+	bool reaping;
+	unsigned nr_reaped;
+	struct reaped_io *reaped;
+
+	// Blocks to read ahead of an ascending stream of locks, 0 for none.
+	unsigned readahead;
+
+	struct block_pool pool;
+	struct block_index index;
+
+	// Scratch space for dm_bm_flush(), big enough for every block.
+	// Only the thread that set @flushing uses it.
+	bool flushing;
+	struct dm_block **flush_batch;
+	struct iovec *flush_iovs;
+	struct flush_workers workers;
+
 	struct list_head held_blocks;
+	struct list_head lru;
+
 	struct block_device *bdev;
 	dm_block_t nr_blocks;
 	bool read_only;
+
+	// Group commit.  Each write bumps @write_seq, and @synced_seq is
+	// the @write_seq the last barrier covered.  The rest are protected
+	// by @sync_lock.
+	pthread_mutex_t sync_lock;
+	pthread_cond_t synced;
+	uint64_t write_seq;
+	uint64_t synced_seq;
+	bool syncing;
+	int sync_error;
+
+	// mmap mode only.  checked[b] is the validator block b last
+	// passed.  It's read and written with atomics, not under @lock.
+	void *mapping;
+	size_t mapping_len;
+	struct dm_block_validator **checked;
 };
 
 dm_block_t dm_block_location(struct dm_block *b)
@@ -40,330 +249,1820 @@ void *dm_block_data(struct dm_block *b)
 
 /*----------------------------------------------------------------*/
 
-static long get_dev_size(struct block_device *bdev)
+static unsigned index_nr_slots_(struct block_index *idx)
 {
-	int r = fseek(bdev->file, 0, SEEK_END);
-	T_ASSERT(!r);
-	long bytes = ftell(bdev->file);
-	T_ASSERT(bytes >= 0);
-	return bytes; 
+	return 1u << idx->bits;
 }
 
-struct dm_block_manager *dm_block_manager_create(
-	struct block_device *bdev, unsigned block_size,
-	unsigned max_held_per_thread)
+static unsigned index_next_(struct block_index *idx, unsigned slot)
 {
-	struct dm_block_manager *bm = malloc(sizeof(*bm));
-
-	if (bm) {
-		bm->block_size = block_size;
-		INIT_LIST_HEAD(&bm->held_blocks);
-		bm->bdev = bdev;
-		bm->nr_blocks = get_dev_size(bdev) / block_size;
-		bm->read_only = false;
-	}
-
-	return bm;
+	return (slot + 1) & (index_nr_slots_(idx) - 1);
 }
 
-void dm_block_manager_destroy(struct dm_block_manager *bm)
+static unsigned index_home_(struct block_index *idx, dm_block_t b)
 {
-	dm_bm_flush(bm);
-	T_ASSERT(list_empty(&bm->held_blocks));
-	free(bm);
+	return hash_64(b, idx->bits);
 }
 
-unsigned dm_bm_block_size(struct dm_block_manager *bm)
+static bool index_init_(struct block_index *idx, unsigned nr_entries)
 {
-	return bm->block_size;
+	idx->bits = 4;
+	while (index_nr_slots_(idx) < 2 * nr_entries)
+		idx->bits++;
+
+	idx->nr_entries = 0;
+	idx->slots = calloc(index_nr_slots_(idx), sizeof(*idx->slots));
+
+	return idx->slots;
 }
 
-dm_block_t dm_bm_nr_blocks(struct dm_block_manager *bm)
+static void index_exit_(struct block_index *idx)
 {
-	return bm->nr_blocks;
+	free(idx->slots);
 }
 
-/*----------------------------------------------------------------*/
-
-static struct dm_block *lookup_block_(struct dm_block_manager *bm, dm_block_t b)
+static struct dm_block *index_lookup_(struct block_index *idx, dm_block_t b)
 {
 	struct dm_block *blk;
-	list_for_each_entry (blk, &bm->held_blocks, list)
+	unsigned slot = index_home_(idx, b);
+
+	while ((blk = idx->slots[slot])) {
 		if (blk->b == b)
 			return blk;
+		slot = index_next_(idx, slot);
+	}
+
 	return NULL;
 }
 
-static bool write_locked_(struct dm_block *blk)
+static void index_insert_(struct block_index *idx, struct dm_block *blk);
+
+static void index_grow_(struct block_index *idx)
 {
-	return blk->lock_count < 0;
+	unsigned i, old_nr_slots = index_nr_slots_(idx);
+	struct dm_block **old_slots = idx->slots;
+	struct dm_block **new_slots = calloc(2 * old_nr_slots, sizeof(*new_slots));
+
+	T_ASSERT(new_slots);
+
+	idx->bits++;
+	idx->nr_entries = 0;
+	idx->slots = new_slots;
+
+	for (i = 0; i < old_nr_slots; i++)
+		if (old_slots[i])
+			index_insert_(idx, old_slots[i]);
+
+	free(old_slots);
 }
 
-static bool read_locked_(struct dm_block *blk)
+static void index_insert_(struct block_index *idx, struct dm_block *blk)
 {
-	return blk->lock_count > 0;
+	unsigned slot;
+
+	if (2 * (idx->nr_entries + 1) > index_nr_slots_(idx))
+		index_grow_(idx);
+
+	slot = index_home_(idx, blk->b);
+	while (idx->slots[slot])
+		slot = index_next_(idx, slot);
+
+	idx->slots[slot] = blk;
+	idx->nr_entries++;
 }
 
-static struct dm_block *alloc_block_(struct dm_block_manager *bm, dm_block_t b,
-                                     struct dm_block_validator *v)
+/*
+ * Backward shift deletion, so we never need tombstones.  Any entry in
+ * the run following the hole that could live in the hole is moved into
+ * it, which then opens a new hole further along.
+ */
+static void index_remove_(struct block_index *idx, struct dm_block *blk)
 {
-	struct dm_block *blk = malloc(sizeof(*blk));
-	if (blk) {
-		blk->bm = bm;
-		INIT_LIST_HEAD(&blk->list);
+	unsigned hole, slot, home, mask = index_nr_slots_(idx) - 1;
 
-		blk->lock_count = 0;
-		blk->b = b;
-		blk->data = malloc(bm->block_size);
-		if (!blk->data) {
-			free(blk);
-			return NULL;
+	hole = index_home_(idx, blk->b);
+	while (idx->slots[hole] != blk) {
+		T_ASSERT(idx->slots[hole]);
+		hole = index_next_(idx, hole);
+	}
+
+	idx->slots[hole] = NULL;
+	idx->nr_entries--;
+
+	for (slot = index_next_(idx, hole); idx->slots[slot];
+	     slot = index_next_(idx, slot)) {
+		home = index_home_(idx, idx->slots[slot]->b);
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			idx->slots[hole] = idx->slots[slot];
+			idx->slots[slot] = NULL;
+			hole = slot;
 		}
-		blk->v = v;
 	}
+}
 
-	return blk;
+/*----------------------------------------------------------------*/
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static void *map_anon_(size_t len, int flags)
+{
+	void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+	return mem == MAP_FAILED ? NULL : mem;
 }
 
-static void free_block_(struct dm_block *blk)
+static bool pool_map_buffers_(struct block_pool *pool, size_t len)
 {
-	if (blk) {
-		free(blk->data);
-		free(blk);
+	if (len >= HUGEPAGE_SIZE) {
+		pool->len = (len + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+		pool->mem = map_anon_(pool->len, MAP_HUGETLB);
+		if (pool->mem)
+			return true;
 	}
+
+	pool->len = len;
+	pool->mem = map_anon_(pool->len, 0);
+	return pool->mem;
 }
 
-static void read_(struct dm_block *blk)
+static bool pool_init_(struct block_pool *pool, unsigned block_size,
+		       unsigned nr_blocks, bool with_buffers)
 {
-	int r;
-	struct dm_block_manager *bm = blk->bm;
+	unsigned i;
 
-	r = fseek(bm->bdev->file, blk->b * bm->block_size, SEEK_SET);
-	T_ASSERT(r >= 0);
+	pool->mem = NULL;
+	pool->len = 0;
+	INIT_LIST_HEAD(&pool->free);
 
-	r = fread(blk->data, bm->block_size, 1, bm->bdev->file);
-	T_ASSERT(r == 1);
-}
+	pool->blocks = calloc(nr_blocks, sizeof(*pool->blocks));
+	if (!pool->blocks)
+		return false;
 
-static void write_(struct dm_block *blk)
-{
-	int r;
-	struct dm_block_manager *bm = blk->bm;
+	if (with_buffers && !pool_map_buffers_(pool, (size_t) block_size * nr_blocks)) {
+		free(pool->blocks);
+		return false;
+	}
 
-	r = fseek(bm->bdev->file, blk->b * bm->block_size, SEEK_SET);
-	T_ASSERT(r >= 0);
+	// Handed out lowest address first.
+	for (i = 0; i < nr_blocks; i++) {
+		if (pool->mem)
+			pool->blocks[i].data = pool->mem + (size_t) i * block_size;
+		list_add_tail(&pool->blocks[i].list, &pool->free);
+	}
 
-	r = fwrite(blk->data, bm->block_size, 1, bm->bdev->file);
-	T_ASSERT(r == 1);
+	return true;
 }
 
-static void prepare_(struct dm_block *blk)
+static void pool_exit_(struct block_pool *pool)
 {
-	if (blk->v)
-		blk->v->prepare_for_write(blk->v, blk, blk->bm->block_size);
+	if (pool->mem)
+		munmap(pool->mem, pool->len);
+	free(pool->blocks);
 }
 
-static void validate_(struct dm_block *blk)
+static struct dm_block *pool_alloc_(struct block_pool *pool)
 {
-	if (blk->v)
-		blk->v->check(blk->v, blk, blk->bm->block_size);
+	struct dm_block *blk;
+
+	if (list_empty(&pool->free))
+		return NULL;
+
+	blk = list_first_entry(&pool->free, struct dm_block, list);
+	list_del_init(&blk->list);
+	return blk;
 }
 
-static struct dm_block *new_block_(struct dm_block_manager *bm, dm_block_t b,
-                                   struct dm_block_validator *v)
+static void pool_free_(struct block_pool *pool, struct dm_block *blk)
 {
-	struct dm_block *blk = alloc_block_(bm, b, v);
-	T_ASSERT(blk);
-	read_(blk);
-	validate_(blk);
-	list_add(&blk->list, &bm->held_blocks);
+	list_add(&blk->list, &pool->free);
+}
 
-	return blk;
+/*----------------------------------------------------------------*/
+
+#define PREFETCH_DEPTH 64
+
+// The most blocks written by one writev at flush time.
+#define MAX_WRITE_RUN 256
+
+#define DEFAULT_READAHEAD 32
+
+#define PREPARE_CHUNK 16
+#define MAX_FLUSH_THREADS 8
+
+/*
+ * Extra trips round the lru a block of each class gets.  Internal nodes
+ * and index blocks are on the path to everything else.
+ */
+static const unsigned class_weights_[DM_BLOCK_NR_CLASSES] = {
+	[DM_BLOCK_BTREE_INTERNAL] = 3,
+	[DM_BLOCK_SM_INDEX] = 3,
+};
+
+static void add_stats_(struct dm_bm_stats *total, struct dm_bm_stats *s)
+{
+	unsigned i;
+
+	total->read_locks += s->read_locks;
+	total->write_locks += s->write_locks;
+	total->zero_locks += s->zero_locks;
+	total->moves += s->moves;
+	total->hits += s->hits;
+	total->misses += s->misses;
+	total->bytes_read += s->bytes_read;
+	total->bytes_written += s->bytes_written;
+	total->writes += s->writes;
+	total->validation_failures += s->validation_failures;
+	total->checksum_ns += s->checksum_ns;
+	total->flushes += s->flushes;
+	total->barriers += s->barriers;
+	total->prefetches_issued += s->prefetches_issued;
+	total->prefetches_used += s->prefetches_used;
+	total->would_blocks += s->would_blocks;
+
+	for (i = 0; i < DM_BLOCK_NR_CLASSES; i++) {
+		total->classes[i].hits += s->classes[i].hits;
+		total->classes[i].misses += s->classes[i].misses;
+	}
 }
 
-int dm_bm_read_lock(struct dm_block_manager *bm, dm_block_t b,
-		    struct dm_block_validator *v,
-		    struct dm_block **result)
+static void sub_stats_(struct dm_bm_stats *total, struct dm_bm_stats *s)
 {
-	struct dm_block *blk = lookup_block_(bm, b);
+	unsigned i;
 
-	if (blk) {
-		T_ASSERT(blk->v == v);
+	total->read_locks -= s->read_locks;
+	total->write_locks -= s->write_locks;
+	total->zero_locks -= s->zero_locks;
+	total->moves -= s->moves;
+	total->hits -= s->hits;
+	total->misses -= s->misses;
+	total->bytes_read -= s->bytes_read;
+	total->bytes_written -= s->bytes_written;
+	total->writes -= s->writes;
+	total->validation_failures -= s->validation_failures;
+	total->checksum_ns -= s->checksum_ns;
+	total->flushes -= s->flushes;
+	total->barriers -= s->barriers;
+	total->prefetches_issued -= s->prefetches_issued;
+	total->prefetches_used -= s->prefetches_used;
+	total->would_blocks -= s->would_blocks;
 
-		// There's no concurrency in the tests, so we can't block
-		T_ASSERT(read_locked_(blk));
-		blk->lock_count++;
-	} else {
-		blk = new_block_(bm, b, v);
-		blk->lock_count = 1;
+	for (i = 0; i < DM_BLOCK_NR_CLASSES; i++) {
+		total->classes[i].hits -= s->classes[i].hits;
+		total->classes[i].misses -= s->classes[i].misses;
 	}
+}
 
-	*result = blk;
-	return 0;
+// Called as a thread exits, while the bm still exists.
+static void thread_exit_(void *context)
+{
+	struct thread_state *ts = context;
+	struct dm_block_manager *bm = ts->bm;
+
+	pthread_mutex_lock(&bm->stats_lock);
+	add_stats_(&bm->exited_stats, &ts->stats);
+	list_del(&ts->list);
+	pthread_mutex_unlock(&bm->stats_lock);
+
+	free(ts);
 }
 
-int dm_bm_write_lock(struct dm_block_manager *bm, dm_block_t b,
-		     struct dm_block_validator *v,
-		     struct dm_block **result)
+static bool init_locks_(struct dm_block_manager *bm)
 {
-	struct dm_block *blk = lookup_block_(bm, b);
-	if (blk)
-		// write locks are exclusive
-		T_ASSERT(false);
+	if (pthread_key_create(&bm->thread_key, thread_exit_))
+		return false;
 
-	blk = new_block_(bm, b, v);
-	blk->lock_count = -1;
-	*result = blk;
-	return 0;
+	pthread_mutex_init(&bm->lock, NULL);
+	pthread_cond_init(&bm->unlocked, NULL);
+	pthread_mutex_init(&bm->stats_lock, NULL);
+	INIT_LIST_HEAD(&bm->threads);
+	memset(&bm->exited_stats, 0, sizeof(bm->exited_stats));
+	memset(&bm->base_stats, 0, sizeof(bm->base_stats));
+
+	return true;
 }
 
-int dm_bm_read_try_lock(struct dm_block_manager *bm, dm_block_t b,
-			struct dm_block_validator *v,
-			struct dm_block **result)
+static void free_locks_(struct dm_block_manager *bm)
 {
-	return dm_bm_read_lock(bm, b, v, result);
+	struct thread_state *ts, *tmp;
+
+	// The destructor won't run once the key's gone, so we free everyone's.
+	pthread_key_delete(bm->thread_key);
+	list_for_each_entry_safe (ts, tmp, &bm->threads, list)
+		free(ts);
+
+	pthread_mutex_destroy(&bm->stats_lock);
+	pthread_cond_destroy(&bm->unlocked);
+	pthread_mutex_destroy(&bm->lock);
 }
 
-int dm_bm_write_lock_zero(struct dm_block_manager *bm, dm_block_t b,
-			  struct dm_block_validator *v,
-			  struct dm_block **result)
+static struct thread_state *thread_state_(struct dm_block_manager *bm)
 {
-	struct dm_block *blk = lookup_block_(bm, b);
-	if (blk)
-		// write locks are exclusive
-		T_ASSERT(false);
+	struct thread_state *ts = pthread_getspecific(bm->thread_key);
 
-	blk = alloc_block_(bm, b, v);
-	T_ASSERT(blk);
-	memset(blk->data, 0, bm->block_size);
-	list_add(&blk->list, &bm->held_blocks);
-	blk->lock_count = -1;
-	*result = blk;
-	return 0;
+	if (!ts) {
+		ts = calloc(1, sizeof(*ts));
+		T_ASSERT(ts);
+		ts->bm = bm;
+		T_ASSERT(!pthread_setspecific(bm->thread_key, ts));
+
+		pthread_mutex_lock(&bm->stats_lock);
+		list_add(&ts->list, &bm->threads);
+		pthread_mutex_unlock(&bm->stats_lock);
+	}
+
+	return ts;
 }
 
-static void drop_block_(struct dm_block *blk)
+static struct dm_bm_stats *stats_(struct dm_block_manager *bm)
 {
-	list_del(&blk->list);
-	free_block_(blk);
+	return &thread_state_(bm)->stats;
 }
 
-void dm_bm_unlock(struct dm_block *blk)
+/*
+ * @with_buffers is false for mmap mode, where only the descriptors are
+ * needed.
+ */
+static struct dm_block_manager *alloc_bm_(struct block_device *bdev, unsigned block_size,
+					  unsigned max_held_per_thread, unsigned cache_size,
+					  bool with_buffers)
 {
-	T_ASSERT(blk->lock_count);
+	struct dm_block_manager *bm = malloc(sizeof(*bm));
 
-	if (write_locked_(blk)) {
-		prepare_(blk);
-		write_(blk);
-		drop_block_(blk);
-	} else {
-		blk->lock_count--;
-		if (!blk->lock_count)
-			drop_block_(blk);
+	if (bm) {
+		if (!init_locks_(bm)) {
+			free(bm);
+			return NULL;
+		}
+		bm->max_held_per_thread = max_held_per_thread;
+
+		bm->block_size = block_size;
+		bm->cache_size = cache_size;
+		bm->nr_cached = 0;
+		if (!index_init_(&bm->index, bm->cache_size)) {
+			free_locks_(bm);
+			free(bm);
+			return NULL;
+		}
+
+		if (!pool_init_(&bm->pool, block_size, bm->cache_size, with_buffers)) {
+			index_exit_(&bm->index);
+			free_locks_(bm);
+			free(bm);
+			return NULL;
+		}
+
+		bm->flush_batch = malloc(sizeof(*bm->flush_batch) * bm->cache_size);
+		bm->flush_iovs = malloc(sizeof(*bm->flush_iovs) * MAX_WRITE_RUN);
+		bm->workers.ready = malloc(bm->cache_size / PREPARE_CHUNK + 1);
+		if (!bm->flush_batch || !bm->flush_iovs || !bm->workers.ready) {
+			free(bm->flush_batch);
+			free(bm->flush_iovs);
+			free(bm->workers.ready);
+			pool_exit_(&bm->pool);
+			index_exit_(&bm->index);
+			free_locks_(bm);
+			free(bm);
+			return NULL;
+		}
+
+		pthread_mutex_init(&bm->workers.lock, NULL);
+		pthread_cond_init(&bm->workers.work, NULL);
+		pthread_cond_init(&bm->workers.done, NULL);
+		bm->workers.nr_threads = 0;
+		bm->workers.threads = NULL;
+		bm->workers.stopping = false;
+		bm->workers.nr = 0;
+		bm->workers.next = 0;
+		bm->workers.nr_busy = 0;
+
+		bm->engine = NULL;
+		bm->nr_in_flight = 0;
+		bm->reaping = false;
+		bm->nr_reaped = 0;
+		bm->reaped = NULL;
+		bm->readahead = 0;
+		bm->flushing = false;
+
+		INIT_LIST_HEAD(&bm->held_blocks);
+		INIT_LIST_HEAD(&bm->lru);
+		bm->bdev = bdev;
+		bm->nr_blocks = bdev->ops->size(bdev) / block_size;
+		bm->read_only = false;
+
+		pthread_mutex_init(&bm->sync_lock, NULL);
+		pthread_cond_init(&bm->synced, NULL);
+		bm->write_seq = 0;
+		bm->synced_seq = 0;
+		bm->syncing = false;
+		bm->sync_error = 0;
+
+		bm->mapping = NULL;
+		bm->mapping_len = 0;
+		bm->checked = NULL;
 	}
+
+	return bm;
 }
 
-int dm_bm_flush(struct dm_block_manager *bm)
+static void stop_flush_threads_(struct dm_block_manager *bm);
+
+static void free_bm_(struct dm_block_manager *bm)
 {
-	// We always write when the lock is dropped.
-	return 0;
+	pthread_cond_destroy(&bm->synced);
+	pthread_mutex_destroy(&bm->sync_lock);
+
+	stop_flush_threads_(bm);
+	pthread_cond_destroy(&bm->workers.done);
+	pthread_cond_destroy(&bm->workers.work);
+	pthread_mutex_destroy(&bm->workers.lock);
+	free(bm->workers.ready);
+
+	if (bm->engine)
+		bm->engine->destroy(bm->engine);
+	free(bm->reaped);
+
+	if (bm->mapping)
+		bm->bdev->ops->unmap(bm->bdev, bm->mapping, bm->mapping_len);
+	free(bm->checked);
+
+	free(bm->flush_iovs);
+	free(bm->flush_batch);
+	pool_exit_(&bm->pool);
+	index_exit_(&bm->index);
+	free_locks_(bm);
+	free(bm);
 }
 
-void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b)
+struct dm_block_manager *dm_block_manager_create(
+	struct block_device *bdev, unsigned block_size,
+	unsigned max_held_per_thread, unsigned cache_size)
 {
-	// Not implemented
+	struct dm_block_manager *bm = alloc_bm_(bdev, block_size, max_held_per_thread,
+						max(cache_size, max_held_per_thread), true);
+
+	if (bm && bdev->ops->create_engine) {
+		bm->engine = bdev->ops->create_engine(bdev, PREFETCH_DEPTH);
+		if (bm->engine)
+			bm->reaped = malloc(sizeof(*bm->reaped) * bm->engine->max_io(bm->engine));
+
+		if (!bm->reaped) {
+			free_bm_(bm);
+			return NULL;
+		}
+		dm_bm_set_readahead(bm, DEFAULT_READAHEAD);
+	}
+
+	if (bm)
+		dm_bm_set_flush_threads(bm, sysconf(_SC_NPROCESSORS_ONLN) - 1);
+
+	return bm;
 }
 
-bool dm_bm_is_read_only(struct dm_block_manager *bm)
+/*
+ * Descriptors are small and there's no io involved in recycling one, so
+ * this only needs to be big enough to keep the index lookups cheap.
+ */
+#define MMAP_NR_DESCRIPTORS 1024
+
+struct dm_block_manager *dm_block_manager_create_mmap(
+	struct block_device *bdev, unsigned block_size,
+	unsigned max_held_per_thread)
 {
-	return bm->read_only;
+	struct dm_block_manager *bm = alloc_bm_(bdev, block_size, max_held_per_thread,
+						max(MMAP_NR_DESCRIPTORS, max_held_per_thread),
+						false);
+
+	if (!bm)
+		return NULL;
+
+	bm->read_only = true;
+	bm->mapping_len = (size_t) bm->nr_blocks * block_size;
+	bm->checked = calloc(max(bm->nr_blocks, (dm_block_t) 1), sizeof(*bm->checked));
+	if (!bm->checked)
+		goto bad;
+
+	if (bm->mapping_len) {
+		bm->mapping = bdev->ops->map(bdev, bm->mapping_len);
+		if (!bm->mapping)
+			goto bad;
+	}
+
+	return bm;
+
+bad:
+	free_bm_(bm);
+	return NULL;
 }
 
-void dm_bm_set_read_only(struct dm_block_manager *bm)
+static bool mapped_(struct dm_block_manager *bm)
 {
-	bm->read_only = true;
+	return bm->checked;
 }
 
-void dm_bm_set_read_write(struct dm_block_manager *bm)
+static void wait_all_(struct dm_block_manager *bm);
+
+void dm_block_manager_destroy(struct dm_block_manager *bm)
 {
-	bm->read_only = false;
+	dm_bm_flush(bm);
+	T_ASSERT(list_empty(&bm->held_blocks));
+
+	wait_all_(bm);
+	free_bm_(bm);
 }
 
-static const uint32_t crc32Table[256] = {
-	0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L,
-	0xC79A971FL, 0x35F1141CL, 0x26A1E7E8L, 0xD4CA64EBL,
-	0x8AD958CFL, 0x78B2DBCCL, 0x6BE22838L, 0x9989AB3BL,
-	0x4D43CFD0L, 0xBF284CD3L, 0xAC78BF27L, 0x5E133C24L,
-	0x105EC76FL, 0xE235446CL, 0xF165B798L, 0x030E349BL,
-	0xD7C45070L, 0x25AFD373L, 0x36FF2087L, 0xC494A384L,
-	0x9A879FA0L, 0x68EC1CA3L, 0x7BBCEF57L, 0x89D76C54L,
-	0x5D1D08BFL, 0xAF768BBCL, 0xBC267848L, 0x4E4DFB4BL,
-	0x20BD8EDEL, 0xD2D60DDDL, 0xC186FE29L, 0x33ED7D2AL,
-	0xE72719C1L, 0x154C9AC2L, 0x061C6936L, 0xF477EA35L,
-	0xAA64D611L, 0x580F5512L, 0x4B5FA6E6L, 0xB93425E5L,
-	0x6DFE410EL, 0x9F95C20DL, 0x8CC531F9L, 0x7EAEB2FAL,
-	0x30E349B1L, 0xC288CAB2L, 0xD1D83946L, 0x23B3BA45L,
-	0xF779DEAEL, 0x05125DADL, 0x1642AE59L, 0xE4292D5AL,
-	0xBA3A117EL, 0x4851927DL, 0x5B016189L, 0xA96AE28AL,
-	0x7DA08661L, 0x8FCB0562L, 0x9C9BF696L, 0x6EF07595L,
-	0x417B1DBCL, 0xB3109EBFL, 0xA0406D4BL, 0x522BEE48L,
-	0x86E18AA3L, 0x748A09A0L, 0x67DAFA54L, 0x95B17957L,
-	0xCBA24573L, 0x39C9C670L, 0x2A993584L, 0xD8F2B687L,
-	0x0C38D26CL, 0xFE53516FL, 0xED03A29BL, 0x1F682198L,
-	0x5125DAD3L, 0xA34E59D0L, 0xB01EAA24L, 0x42752927L,
-	0x96BF4DCCL, 0x64D4CECFL, 0x77843D3BL, 0x85EFBE38L,
-	0xDBFC821CL, 0x2997011FL, 0x3AC7F2EBL, 0xC8AC71E8L,
-	0x1C661503L, 0xEE0D9600L, 0xFD5D65F4L, 0x0F36E6F7L,
-	0x61C69362L, 0x93AD1061L, 0x80FDE395L, 0x72966096L,
-	0xA65C047DL, 0x5437877EL, 0x4767748AL, 0xB50CF789L,
-	0xEB1FCBADL, 0x197448AEL, 0x0A24BB5AL, 0xF84F3859L,
-	0x2C855CB2L, 0xDEEEDFB1L, 0xCDBE2C45L, 0x3FD5AF46L,
-	0x7198540DL, 0x83F3D70EL, 0x90A324FAL, 0x62C8A7F9L,
-	0xB602C312L, 0x44694011L, 0x5739B3E5L, 0xA55230E6L,
-	0xFB410CC2L, 0x092A8FC1L, 0x1A7A7C35L, 0xE811FF36L,
-	0x3CDB9BDDL, 0xCEB018DEL, 0xDDE0EB2AL, 0x2F8B6829L,
-	0x82F63B78L, 0x709DB87BL, 0x63CD4B8FL, 0x91A6C88CL,
-	0x456CAC67L, 0xB7072F64L, 0xA457DC90L, 0x563C5F93L,
-	0x082F63B7L, 0xFA44E0B4L, 0xE9141340L, 0x1B7F9043L,
-	0xCFB5F4A8L, 0x3DDE77ABL, 0x2E8E845FL, 0xDCE5075CL,
-	0x92A8FC17L, 0x60C37F14L, 0x73938CE0L, 0x81F80FE3L,
-	0x55326B08L, 0xA759E80BL, 0xB4091BFFL, 0x466298FCL,
-	0x1871A4D8L, 0xEA1A27DBL, 0xF94AD42FL, 0x0B21572CL,
-	0xDFEB33C7L, 0x2D80B0C4L, 0x3ED04330L, 0xCCBBC033L,
-	0xA24BB5A6L, 0x502036A5L, 0x4370C551L, 0xB11B4652L,
-	0x65D122B9L, 0x97BAA1BAL, 0x84EA524EL, 0x7681D14DL,
-	0x2892ED69L, 0xDAF96E6AL, 0xC9A99D9EL, 0x3BC21E9DL,
-	0xEF087A76L, 0x1D63F975L, 0x0E330A81L, 0xFC588982L,
-	0xB21572C9L, 0x407EF1CAL, 0x532E023EL, 0xA145813DL,
-	0x758FE5D6L, 0x87E466D5L, 0x94B49521L, 0x66DF1622L,
-	0x38CC2A06L, 0xCAA7A905L, 0xD9F75AF1L, 0x2B9CD9F2L,
-	0xFF56BD19L, 0x0D3D3E1AL, 0x1E6DCDEEL, 0xEC064EEDL,
-	0xC38D26C4L, 0x31E6A5C7L, 0x22B65633L, 0xD0DDD530L,
-	0x0417B1DBL, 0xF67C32D8L, 0xE52CC12CL, 0x1747422FL,
-	0x49547E0BL, 0xBB3FFD08L, 0xA86F0EFCL, 0x5A048DFFL,
-	0x8ECEE914L, 0x7CA56A17L, 0x6FF599E3L, 0x9D9E1AE0L,
-	0xD3D3E1ABL, 0x21B862A8L, 0x32E8915CL, 0xC083125FL,
-	0x144976B4L, 0xE622F5B7L, 0xF5720643L, 0x07198540L,
-	0x590AB964L, 0xAB613A67L, 0xB831C993L, 0x4A5A4A90L,
-	0x9E902E7BL, 0x6CFBAD78L, 0x7FAB5E8CL, 0x8DC0DD8FL,
-	0xE330A81AL, 0x115B2B19L, 0x020BD8EDL, 0xF0605BEEL,
-	0x24AA3F05L, 0xD6C1BC06L, 0xC5914FF2L, 0x37FACCF1L,
-	0x69E9F0D5L, 0x9B8273D6L, 0x88D28022L, 0x7AB90321L,
-	0xAE7367CAL, 0x5C18E4C9L, 0x4F48173DL, 0xBD23943EL,
-	0xF36E6F75L, 0x0105EC76L, 0x12551F82L, 0xE03E9C81L,
-	0x34F4F86AL, 0xC69F7B69L, 0xD5CF889DL, 0x27A40B9EL,
-	0x79B737BAL, 0x8BDCB4B9L, 0x988C474DL, 0x6AE7C44EL,
-	0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
-};
+unsigned dm_bm_block_size(struct dm_block_manager *bm)
+{
+	return bm->block_size;
+}
 
-u32 dm_bm_checksum(const void *buf, size_t size, u32 crc)
+dm_block_t dm_bm_nr_blocks(struct dm_block_manager *bm)
 {
-	const uint8_t *p = buf;
+	return bm->nr_blocks;
+}
 
-	while (size--)
-		crc = crc32Table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+/*----------------------------------------------------------------*/
 
-	return crc;
+static struct dm_block *lookup_block_(struct dm_block_manager *bm, dm_block_t b)
+{
+	return index_lookup_(&bm->index, b);
+}
+
+static bool write_locked_(struct dm_block *blk)
+{
+	return blk->lock_count < 0;
+}
+
+static bool held_(struct dm_block *blk)
+{
+	return blk->lock_count != 0;
+}
+
+static void lock_bm_(struct dm_block_manager *bm)
+{
+	pthread_mutex_lock(&bm->lock);
+}
+
+static void unlock_bm_(struct dm_block_manager *bm)
+{
+	pthread_mutex_unlock(&bm->lock);
+}
+
+static struct dm_block *alloc_block_(struct dm_block_manager *bm, dm_block_t b,
+                                     struct dm_block_validator *v)
+{
+	struct dm_block *blk = pool_alloc_(&bm->pool);
+	if (blk) {
+		blk->bm = bm;
+		blk->lock_count = 0;
+		blk->b = b;
+		blk->dirty = false;
+		blk->io_pending = false;
+		blk->io_error = 0;
+		blk->writing = false;
+		blk->prefetched = false;
+		blk->validated = false;
+		blk->class = DM_BLOCK_OTHER;
+		blk->credits = 0;
+		blk->v = v;
+	}
+
+	return blk;
+}
+
+static void read_(struct dm_block *blk)
+{
+	struct dm_block_manager *bm = blk->bm;
+
+	T_ASSERT(!bdev_read(bm->bdev, blk->data, bm->block_size,
+			    (off_t) blk->b * bm->block_size));
+	stats_(bm)->bytes_read += bm->block_size;
+}
+
+static void write_(struct dm_block *blk)
+{
+	struct dm_block_manager *bm = blk->bm;
+
+	T_ASSERT(!bdev_write(bm->bdev, blk->data, bm->block_size,
+			     (off_t) blk->b * bm->block_size));
+	__atomic_add_fetch(&bm->write_seq, 1, __ATOMIC_RELEASE);
+	stats_(bm)->bytes_written += bm->block_size;
+	stats_(bm)->writes++;
+}
+
+static uint64_t now_ns_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void prepare_(struct dm_block *blk)
+{
+	uint64_t start;
+
+	if (blk->v) {
+		start = now_ns_();
+		blk->v->prepare_for_write(blk->v, blk, blk->bm->block_size);
+		stats_(blk->bm)->checksum_ns += now_ns_() - start;
+	}
+}
+
+static void classify_(struct dm_block *blk)
+{
+	struct dm_block_validator *v = blk->v;
+
+	blk->class = (v && v->classify) ?
+		v->classify(v, blk, blk->bm->block_size) : DM_BLOCK_OTHER;
+}
+
+static int validate_(struct dm_block *blk)
+{
+	int r = 0;
+	uint64_t start;
+	struct dm_bm_stats *stats = stats_(blk->bm);
+
+	if (blk->v) {
+		start = now_ns_();
+		r = blk->v->check(blk->v, blk, blk->bm->block_size);
+		stats->checksum_ns += now_ns_() - start;
+	}
+
+	if (r)
+		stats->validation_failures++;
+	else
+		classify_(blk);
+
+	blk->validated = !r;
+	return r;
+}
+
+// Called by the engine from within reap_(), so without @lock.
+static void complete_io_(void *context, int io_error)
+{
+	struct dm_block *blk = context;
+	struct reaped_io *io = blk->bm->reaped + blk->bm->nr_reaped++;
+
+	io->blk = blk;
+	io->io_error = io_error;
+}
+
+/*
+ * Waits on the engine for some io to complete, with @lock dropped.
+ * Nothing may be issued meanwhile, so prefetch_() backs off while
+ * @reaping is set.
+ */
+static int reap_(struct dm_block_manager *bm)
+{
+	unsigned i;
+	bool waited;
+	struct dm_block *blk;
+	struct io_engine *e = bm->engine;
+
+	bm->reaping = true;
+	bm->nr_reaped = 0;
+	unlock_bm_(bm);
+	waited = e->wait(e, complete_io_);
+	lock_bm_(bm);
+	bm->reaping = false;
+
+	for (i = 0; i < bm->nr_reaped; i++) {
+		blk = bm->reaped[i].blk;
+		blk->io_pending = false;
+		blk->io_error = bm->reaped[i].io_error;
+		bm->nr_in_flight--;
+	}
+	pthread_cond_broadcast(&bm->unlocked);
+
+	return waited ? 0 : -EIO;
+}
+
+/*
+ * Waits for a prefetch into @blk to finish.  @lock is dropped while we
+ * wait, so the caller must look again at anything else it cares about.
+ */
+static int wait_io_(struct dm_block *blk)
+{
+	int r;
+	struct dm_block_manager *bm = blk->bm;
+
+	while (blk->io_pending) {
+		if (bm->reaping) {
+			pthread_cond_wait(&bm->unlocked, &bm->lock);
+			continue;
+		}
+
+		r = reap_(bm);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+static void wait_all_(struct dm_block_manager *bm)
+{
+	lock_bm_(bm);
+	while (bm->nr_in_flight)
+		T_ASSERT(!reap_(bm));
+	unlock_bm_(bm);
+}
+
+/*
+ * Moves a resident, but unheld, block back onto the held list.
+ */
+static void hold_block_(struct dm_block *blk)
+{
+	list_move(&blk->list, &blk->bm->held_blocks);
+}
+
+/*
+ * The block stays resident, it just becomes a candidate for recycling.
+ */
+static void release_block_(struct dm_block *blk)
+{
+	blk->credits = class_weights_[blk->class];
+	list_move(&blk->list, &blk->bm->lru);
+	pthread_cond_broadcast(&blk->bm->unlocked);
+}
+
+/*
+ * Drops a block that failed validation, so the next lock rereads it
+ * rather than trusting the cached copy.  The block mustn't be dirty.
+ */
+static void evict_block_(struct dm_block *blk)
+{
+	struct dm_block_manager *bm = blk->bm;
+
+	index_remove_(&bm->index, blk);
+	list_del(&blk->list);
+	pool_free_(&bm->pool, blk);
+	bm->nr_cached--;
+
+	// Anyone waiting for it will find it gone and read it themselves.
+	pthread_cond_broadcast(&bm->unlocked);
+}
+
+/*
+ * The least recently used block that's out of credits.  Blocks with
+ * credits left get another trip round the lru instead, so a block of a
+ * class with weight n survives n + 1 times as long without being used.
+ */
+static struct dm_block *lru_victim_(struct dm_block_manager *bm)
+{
+	struct dm_block *blk;
+
+	while (!list_empty(&bm->lru)) {
+		blk = list_last_entry(&bm->lru, struct dm_block, list);
+		if (!blk->credits)
+			return blk;
+
+		blk->credits--;
+		list_move(&blk->list, &bm->lru);
+	}
+
+	return NULL;
+}
+
+/*
+ * The block lru_victim_() would return, without spending any credits.
+ * Each trip round the list costs every block one credit and keeps their
+ * order, so it's the one nearest the tail with the fewest credits.
+ */
+static struct dm_block *peek_victim_(struct dm_block_manager *bm)
+{
+	struct dm_block *blk, *victim = NULL;
+
+	list_for_each_entry_reverse (blk, &bm->lru, list) {
+		if (!victim || blk->credits < victim->credits)
+			victim = blk;
+
+		if (!blk->credits)
+			break;
+	}
+
+	return victim;
+}
+
+static void set_write_locked_(struct dm_block *blk)
+{
+	blk->lock_count = -1;
+	blk->writer = pthread_self();
+}
+
+/*
+ * Checks a resident block before it's locked.  Normally it's been
+ * validated already, and all we do is make sure the caller is using the
+ * same validator.  A prefetched block gets checked the first time it's
+ * locked, since that's when we find out which validator it's meant to
+ * have.
+ */
+static int check_resident_(struct dm_block *blk, struct dm_block_validator *v)
+{
+	struct dm_block_manager *bm = blk->bm;
+
+	if (blk->prefetched) {
+		stats_(bm)->prefetches_used++;
+		blk->prefetched = false;
+	}
+
+	if (blk->validated) {
+		T_ASSERT(blk->v == v);
+		return 0;
+	}
+
+	// If the async read failed we try again synchronously, like a
+	// miss: write locked, and with @lock dropped.  Only validated
+	// blocks are ever held, so nobody else has this one.
+	if (blk->io_error) {
+		hold_block_(blk);
+		set_write_locked_(blk);
+		unlock_bm_(bm);
+		read_(blk);
+		lock_bm_(bm);
+		blk->lock_count = 0;
+		blk->io_error = 0;
+
+		// Waiters will see it once our caller has locked it.
+		pthread_cond_broadcast(&bm->unlocked);
+	}
+
+	blk->v = v;
+	return validate_(blk);
+}
+
+/*
+ * A victim that's dirty, or still being prefetched into, needs io before
+ * it can be recycled.  That's done with @lock dropped and the victim
+ * write locked, so nobody uses it meanwhile.  Afterwards it goes back on
+ * the tail of the lru, clean and unheld, and the caller starts again,
+ * since anything may have changed while @lock was dropped.
+ */
+static int clean_victim_(struct dm_block *blk)
+{
+	int r = 0;
+	struct dm_block_manager *bm = blk->bm;
+
+	hold_block_(blk);
+	set_write_locked_(blk);
+
+	if (blk->io_pending)
+		r = wait_io_(blk);
+	else {
+		blk->writing = true;
+		unlock_bm_(bm);
+		prepare_(blk);
+		write_(blk);
+		lock_bm_(bm);
+		blk->writing = false;
+		blk->dirty = false;
+	}
+
+	blk->lock_count = 0;
+	list_move_tail(&blk->list, &bm->lru);
+	pthread_cond_broadcast(&bm->unlocked);
+
+	return r;
+}
+
+/*
+ * Gets a block that isn't on any list, either freshly allocated or
+ * recycled from the tail of the lru.  -ENOMEM if the cache is full and
+ * every resident block is held.  -EAGAIN if the victim needed io first,
+ * in which case @lock was dropped, and the caller should look up what
+ * it wants again before retrying.
+ */
+static int get_free_block_(struct dm_block_manager *bm, dm_block_t b,
+			   struct dm_block_validator *v, struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+
+	if (bm->nr_cached < bm->cache_size) {
+		blk = alloc_block_(bm, b, v);
+		if (!blk)
+			return -ENOMEM;
+
+		bm->nr_cached++;
+		*result = blk;
+		return 0;
+	}
+
+	blk = lru_victim_(bm);
+	if (!blk)
+		return -ENOMEM;
+
+	if (blk->io_pending || blk->dirty) {
+		r = clean_victim_(blk);
+		return r ? r : -EAGAIN;
+	}
+
+	list_del_init(&blk->list);
+	index_remove_(&bm->index, blk);
+	blk->b = b;
+	blk->v = v;
+	blk->validated = false;
+	blk->io_error = 0;
+	blk->prefetched = false;
+	blk->class = DM_BLOCK_OTHER;
+	blk->credits = 0;
+
+	*result = blk;
+	return 0;
+}
+
+/*
+ * Reserves one of this thread's held blocks.  Taking more than
+ * max_held_per_thread locks risks deadlock, so it's refused.
+ */
+static int get_held_(struct dm_block_manager *bm)
+{
+	unsigned *nr = &thread_state_(bm)->nr_held;
+
+	if (*nr >= bm->max_held_per_thread)
+		return -EINVAL;
+
+	(*nr)++;
+	return 0;
+}
+
+static void put_held_(struct dm_block_manager *bm)
+{
+	thread_state_(bm)->nr_held--;
+}
+
+/*
+ * Looks up a resident block, waiting until any prefetch into it is done
+ * and it can be locked in the requested mode.  The block may be recycled
+ * while we sleep, so we look it up again each time we wake.  *result is
+ * NULL if it's not resident.
+ */
+static int find_block_(struct dm_block_manager *bm, dm_block_t b, bool write,
+		       struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+
+	for (;;) {
+		blk = lookup_block_(bm, b);
+		if (blk && blk->io_pending) {
+			r = wait_io_(blk);
+			if (r)
+				return r;
+			continue;
+		}
+
+		if (!blk || !(write ? held_(blk) : write_locked_(blk))) {
+			*result = blk;
+			return 0;
+		}
+
+		// Waiting on a write lock we hold ourselves would never end.
+		T_ASSERT(!(write_locked_(blk) && pthread_equal(blk->writer, pthread_self())));
+		pthread_cond_wait(&bm->unlocked, &bm->lock);
+	}
+}
+
+/*
+ * Reads a block that isn't resident.  The block is write locked, and
+ * visible in the index, while the read happens with @lock dropped;
+ * anyone else who wants it waits in find_block_().
+ */
+static int new_block_(struct dm_block_manager *bm, dm_block_t b,
+		      struct dm_block_validator *v, struct dm_block **result)
+{
+	struct dm_block *blk;
+	int r = get_free_block_(bm, b, v, &blk);
+	if (r)
+		return r;
+
+	set_write_locked_(blk);
+	index_insert_(&bm->index, blk);
+	list_add(&blk->list, &bm->held_blocks);
+	unlock_bm_(bm);
+
+	if (mapped_(bm)) {
+		// Each block is checked once per mapping, however often it's recycled.
+		blk->data = bm->mapping + b * bm->block_size;
+		if (__atomic_load_n(bm->checked + b, __ATOMIC_ACQUIRE) == v) {
+			blk->validated = true;
+			classify_(blk);
+		} else {
+			r = validate_(blk);
+			if (!r)
+				__atomic_store_n(bm->checked + b, v, __ATOMIC_RELEASE);
+		}
+	} else {
+		read_(blk);
+		r = validate_(blk);
+	}
+
+	lock_bm_(bm);
+	if (r) {
+		evict_block_(blk);
+		return r;
+	}
+
+	*result = blk;
+	return 0;
+}
+
+/*
+ * Cursors and free block searches lock blocks in roughly ascending
+ * order, since btree leaves and bitmaps tend to be allocated
+ * contiguously.  Once a thread has locked a few blocks in a row, each
+ * no more than a small gap past the last, we keep the next
+ * bm->readahead blocks prefetched.  readahead_end stops us reissuing
+ * prefetches for blocks we've already covered.
+ */
+#define STREAM_MIN_LEN 2
+#define STREAM_MAX_GAP 4
+
+static void readahead_(struct dm_block_manager *bm, dm_block_t b)
+{
+	dm_block_t i, end;
+	struct thread_state *ts;
+
+	if (!bm->readahead)
+		return;
+
+	ts = thread_state_(bm);
+	if (b > ts->last_locked && b - ts->last_locked <= STREAM_MAX_GAP)
+		ts->stream_len++;
+
+	else if (b != ts->last_locked) {
+		ts->stream_len = 0;
+		ts->readahead_end = 0;
+	}
+	ts->last_locked = b;
+
+	if (ts->stream_len < STREAM_MIN_LEN)
+		return;
+
+	end = min(b + 1 + bm->readahead, bm->nr_blocks);
+	for (i = max(b + 1, ts->readahead_end); i < end; i++)
+		dm_bm_prefetch(bm, i);
+	ts->readahead_end = end;
+}
+
+int dm_bm_read_lock(struct dm_block_manager *bm, dm_block_t b,
+		    struct dm_block_validator *v,
+		    struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+	struct dm_bm_stats *stats = stats_(bm);
+
+	stats->read_locks++;
+	if (b >= bm->nr_blocks)
+		return -EINVAL;
+
+	r = get_held_(bm);
+	if (r)
+		return r;
+
+	lock_bm_(bm);
+retry:
+	r = find_block_(bm, b, false, &blk);
+	if (r)
+		goto out;
+
+	if (blk) {
+		stats->hits++;
+		r = check_resident_(blk, v);
+		if (r)
+			goto bad;
+
+		if (!held_(blk))
+			hold_block_(blk);
+		blk->lock_count++;
+		stats->classes[blk->class].hits++;
+	} else {
+		r = new_block_(bm, b, v, &blk);
+		if (r == -EAGAIN)
+			goto retry;
+
+		stats->misses++;
+		if (r)
+			goto out;
+
+		// Let in anyone who was waiting for the read to finish.
+		blk->lock_count = 1;
+		pthread_cond_broadcast(&bm->unlocked);
+		stats->classes[blk->class].misses++;
+	}
+	unlock_bm_(bm);
+
+	readahead_(bm, b);
+	*result = blk;
+	return 0;
+
+bad:
+	// Only prefetched blocks fail here, and they're never held.
+	evict_block_(blk);
+out:
+	unlock_bm_(bm);
+	put_held_(bm);
+	return r;
+}
+
+int dm_bm_write_lock(struct dm_block_manager *bm, dm_block_t b,
+		     struct dm_block_validator *v,
+		     struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+	struct dm_bm_stats *stats = stats_(bm);
+
+	stats->write_locks++;
+	if (bm->read_only)
+		return -EPERM;
+
+	if (b >= bm->nr_blocks)
+		return -EINVAL;
+
+	r = get_held_(bm);
+	if (r)
+		return r;
+
+	lock_bm_(bm);
+retry:
+	r = find_block_(bm, b, true, &blk);
+	if (r)
+		goto out;
+
+	if (blk) {
+		stats->hits++;
+		r = check_resident_(blk, v);
+		if (r) {
+			evict_block_(blk);
+			goto out;
+		}
+
+		hold_block_(blk);
+		set_write_locked_(blk);
+		stats->classes[blk->class].hits++;
+	} else {
+		r = new_block_(bm, b, v, &blk);
+		if (r == -EAGAIN)
+			goto retry;
+
+		stats->misses++;
+		if (r)
+			goto out;
+		stats->classes[blk->class].misses++;
+	}
+	unlock_bm_(bm);
+
+	readahead_(bm, b);
+	*result = blk;
+	return 0;
+
+out:
+	unlock_bm_(bm);
+	put_held_(bm);
+	return r;
+}
+
+static void prefetch_(struct dm_block_manager *bm, dm_block_t b, bool may_block);
+
+/*
+ * Only succeeds if the block is cached, unlocked or read locked, and
+ * either validated or just needing its checksum checked.  Anything that
+ * would mean waiting for io fails, and a missing block is prefetched so
+ * it's likely to be there when the caller tries again.
+ */
+int dm_bm_read_try_lock(struct dm_block_manager *bm, dm_block_t b,
+			struct dm_block_validator *v,
+			struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+	struct dm_bm_stats *stats = stats_(bm);
+
+	stats->read_locks++;
+	if (b >= bm->nr_blocks)
+		return -EINVAL;
+
+	r = get_held_(bm);
+	if (r)
+		return r;
+
+	lock_bm_(bm);
+	blk = lookup_block_(bm, b);
+	if (!blk) {
+		prefetch_(bm, b, false);
+		r = -EWOULDBLOCK;
+		goto out;
+	}
+
+	if (write_locked_(blk) || blk->io_pending || blk->io_error) {
+		r = -EWOULDBLOCK;
+		goto out;
+	}
+
+	stats->hits++;
+	r = check_resident_(blk, v);
+	if (r) {
+		// Held blocks are always validated, so this one isn't held.
+		evict_block_(blk);
+		goto out;
+	}
+
+	if (!held_(blk))
+		hold_block_(blk);
+	blk->lock_count++;
+	stats->classes[blk->class].hits++;
+	unlock_bm_(bm);
+
+	*result = blk;
+	return 0;
+
+out:
+	if (r == -EWOULDBLOCK)
+		stats->would_blocks++;
+	unlock_bm_(bm);
+	put_held_(bm);
+	return r;
+}
+
+int dm_bm_write_lock_zero(struct dm_block_manager *bm, dm_block_t b,
+			  struct dm_block_validator *v,
+			  struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk;
+
+	stats_(bm)->zero_locks++;
+	if (bm->read_only)
+		return -EPERM;
+
+	if (b >= bm->nr_blocks)
+		return -EINVAL;
+
+	r = get_held_(bm);
+	if (r)
+		return r;
+
+	lock_bm_(bm);
+retry:
+	r = find_block_(bm, b, true, &blk);
+	if (r)
+		goto out;
+
+	if (blk) {
+		hold_block_(blk);
+
+		// The data's about to be zeroed, so there's nothing to check.
+		blk->io_error = 0;
+		blk->prefetched = false;
+		blk->v = v;
+	} else {
+		r = get_free_block_(bm, b, v, &blk);
+		if (r == -EAGAIN)
+			goto retry;
+
+		if (r)
+			goto out;
+		index_insert_(&bm->index, blk);
+		list_add(&blk->list, &bm->held_blocks);
+	}
+	set_write_locked_(blk);
+	blk->validated = true;
+	unlock_bm_(bm);
+
+	memset(blk->data, 0, bm->block_size);
+	*result = blk;
+	return 0;
+
+out:
+	unlock_bm_(bm);
+	put_held_(bm);
+	return r;
+}
+
+/*
+ * Only a clean block can move, since its data must still be on disk at
+ * the old location for anyone who reads that later.  Whatever is cached
+ * for the new location is stale, as the caller is about to overwrite it.
+ */
+int dm_bm_write_lock_move(struct dm_block_manager *bm, dm_block_t old, dm_block_t new,
+			  struct dm_block_validator *v,
+			  struct dm_block **result)
+{
+	int r;
+	struct dm_block *blk, *stale;
+
+	T_ASSERT(old != new);
+
+	// An mmap bm is always read only.
+	if (bm->read_only)
+		return -EPERM;
+
+	if (new >= bm->nr_blocks)
+		return -EINVAL;
+
+	r = get_held_(bm);
+	if (r)
+		return r;
+
+	lock_bm_(bm);
+	blk = lookup_block_(bm, old);
+	if (!blk || held_(blk) || blk->dirty || blk->io_pending ||
+	    !blk->validated || blk->v != v) {
+		r = -ENODATA;
+		goto out;
+	}
+
+	// Rather than wait for a stale block, we let the caller copy.
+	stale = lookup_block_(bm, new);
+	if (stale) {
+		if (held_(stale) || stale->io_pending) {
+			r = -ENODATA;
+			goto out;
+		}
+
+		evict_block_(stale);
+	}
+
+	index_remove_(&bm->index, blk);
+	blk->b = new;
+	index_insert_(&bm->index, blk);
+	hold_block_(blk);
+	set_write_locked_(blk);
+	blk->prefetched = false;
+	stats_(bm)->moves++;
+	unlock_bm_(bm);
+
+	*result = blk;
+	return 0;
+
+out:
+	unlock_bm_(bm);
+	put_held_(bm);
+	return r;
+}
+
+void dm_bm_unlock(struct dm_block *blk)
+{
+	struct dm_block_manager *bm = blk->bm;
+
+	lock_bm_(bm);
+	T_ASSERT(blk->lock_count);
+
+	if (write_locked_(blk)) {
+		// The write may have changed what the block is.
+		classify_(blk);
+		blk->dirty = true;
+		blk->lock_count = 0;
+		release_block_(blk);
+	} else {
+		blk->lock_count--;
+		if (!blk->lock_count)
+			release_block_(blk);
+	}
+	unlock_bm_(bm);
+
+	put_held_(bm);
+}
+
+static int cmp_block_(const void *lhs, const void *rhs)
+{
+	dm_block_t l = (*((struct dm_block **) lhs))->b;
+	dm_block_t r = (*((struct dm_block **) rhs))->b;
+
+	return l < r ? -1 : l > r;
+}
+
+/*----------------------------------------------------------------
+ * Parallel prepare_for_write
+ *
+ * Flush starts the workers on the sorted batch, then writes each run as
+ * soon as its chunks are prepared, so checksumming overlaps the io.
+ * Rather than sit waiting, the flushing thread prepares chunks itself,
+ * so with no workers each chunk is prepared just before it's written.
+ *--------------------------------------------------------------*/
+
+// Returns false once every chunk has been claimed.
+static bool prepare_chunk_(struct dm_block_manager *bm, unsigned nr)
+{
+	struct flush_workers *w = &bm->workers;
+	unsigned i, end, start = __atomic_fetch_add(&w->next, PREPARE_CHUNK, __ATOMIC_RELAXED);
+
+	if (start >= nr)
+		return false;
+
+	end = min(start + PREPARE_CHUNK, nr);
+	for (i = start; i < end; i++)
+		prepare_(bm->flush_batch[i]);
+
+	__atomic_store_n(w->ready + start / PREPARE_CHUNK, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_broadcast(&w->done);
+	pthread_mutex_unlock(&w->lock);
+
+	return true;
+}
+
+static void *flush_worker_(void *context)
+{
+	unsigned nr;
+	struct dm_block_manager *bm = context;
+	struct flush_workers *w = &bm->workers;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->stopping && __atomic_load_n(&w->next, __ATOMIC_RELAXED) >= w->nr)
+			pthread_cond_wait(&w->work, &w->lock);
+
+		if (w->stopping)
+			break;
+
+		nr = w->nr;
+		w->nr_busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		while (prepare_chunk_(bm, nr))
+			;
+
+		pthread_mutex_lock(&w->lock);
+		w->nr_busy--;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static void stop_flush_threads_(struct dm_block_manager *bm)
+{
+	unsigned i;
+	struct flush_workers *w = &bm->workers;
+
+	pthread_mutex_lock(&w->lock);
+	w->stopping = true;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->nr_threads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	free(w->threads);
+	w->threads = NULL;
+	w->nr_threads = 0;
+	w->stopping = false;
+}
+
+static void start_prepare_(struct dm_block_manager *bm, unsigned nr)
+{
+	struct flush_workers *w = &bm->workers;
+
+	pthread_mutex_lock(&w->lock);
+	memset(w->ready, 0, nr / PREPARE_CHUNK + 1);
+	w->next = 0;
+	w->nr = nr;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Waits for chunk @c to be prepared.
+static void wait_prepared_(struct dm_block_manager *bm, unsigned c, unsigned nr)
+{
+	struct flush_workers *w = &bm->workers;
+
+	while (!__atomic_load_n(w->ready + c, __ATOMIC_ACQUIRE)) {
+		if (prepare_chunk_(bm, nr))
+			continue;
+
+		// Everything's claimed, so a worker has chunk c.
+		pthread_mutex_lock(&w->lock);
+		while (!__atomic_load_n(w->ready + c, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&w->done, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+// Once this returns no worker is looking at the batch.
+static void end_prepare_(struct dm_block_manager *bm)
+{
+	struct flush_workers *w = &bm->workers;
+
+	pthread_mutex_lock(&w->lock);
+	w->nr = 0;
+	while (w->nr_busy)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Writes @nr prepared blocks, which must be adjacent on disk, with one
+ * writev.
+ */
+static void write_run_(struct dm_block_manager *bm, struct dm_block **blks, unsigned nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		bm->flush_iovs[i].iov_base = blks[i]->data;
+		bm->flush_iovs[i].iov_len = bm->block_size;
+	}
+
+	T_ASSERT(!bdev_writev(bm->bdev, bm->flush_iovs, nr, (off_t) blks[0]->b * bm->block_size));
+	__atomic_add_fetch(&bm->write_seq, 1, __ATOMIC_RELEASE);
+	stats_(bm)->bytes_written += (uint64_t) nr * bm->block_size;
+	stats_(bm)->writes++;
+}
+
+/*
+ * Returns once a barrier has covered every write up to @seq.  One
+ * thread at a time issues the barrier, covering everything written
+ * when it started; threads that arrive meanwhile wait for the next.
+ */
+static int sync_to_(struct dm_block_manager *bm, uint64_t seq)
+{
+	int r;
+	uint64_t target;
+
+	pthread_mutex_lock(&bm->sync_lock);
+	while (bm->synced_seq < seq && !bm->sync_error) {
+		if (bm->syncing) {
+			pthread_cond_wait(&bm->synced, &bm->sync_lock);
+			continue;
+		}
+
+		bm->syncing = true;
+		target = __atomic_load_n(&bm->write_seq, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&bm->sync_lock);
+
+		r = bdev_sync(bm->bdev);
+		stats_(bm)->barriers++;
+
+		pthread_mutex_lock(&bm->sync_lock);
+		bm->syncing = false;
+		if (r)
+			bm->sync_error = r;
+		else
+			bm->synced_seq = target;
+		pthread_cond_broadcast(&bm->synced);
+	}
+	r = bm->sync_error;
+	pthread_mutex_unlock(&bm->sync_lock);
+
+	return r;
+}
+
+/*
+ * Waits until the batch is ours and no dirty block is write locked, so
+ * every dirty block can be read locked and written.  Write backs started
+ * by recycling are waited for too, so our barrier covers them.  Waiting
+ * for another thread's write lock could deadlock if we hold any locks
+ * ourselves, so then we give up, as we do if the write lock is ours.
+ */
+static int wait_writers_(struct dm_block_manager *bm)
+{
+	struct dm_block *blk;
+
+retry:
+	if (bm->flushing) {
+		pthread_cond_wait(&bm->unlocked, &bm->lock);
+		goto retry;
+	}
+
+	list_for_each_entry (blk, &bm->held_blocks, list) {
+		if (!blk->writing) {
+			if (!blk->dirty || !write_locked_(blk))
+				continue;
+
+			if (pthread_equal(blk->writer, pthread_self()) ||
+			    thread_state_(bm)->nr_held)
+				return -EBUSY;
+		}
+
+		pthread_cond_wait(&bm->unlocked, &bm->lock);
+		goto retry;
+	}
+
+	return 0;
+}
+
+int dm_bm_flush(struct dm_block_manager *bm)
+{
+	int r;
+	unsigned nr = 0, run, i, c;
+	uint64_t seq;
+	struct dm_block *blk, **batch = bm->flush_batch;
+
+	stats_(bm)->flushes++;
+	lock_bm_(bm);
+	r = wait_writers_(bm);
+	if (r) {
+		unlock_bm_(bm);
+		return r;
+	}
+
+	list_for_each_entry (blk, &bm->lru, list)
+		if (blk->dirty)
+			batch[nr++] = blk;
+
+	list_for_each_entry (blk, &bm->held_blocks, list)
+		if (blk->dirty)
+			batch[nr++] = blk;
+
+	// Read locked, they can't be changed or recycled while they're
+	// written with @lock dropped, but can still be read.
+	// prepare_for_write only fills in the checksum, which readers
+	// don't look at.
+	for (i = 0; i < nr; i++) {
+		if (!held_(batch[i]))
+			hold_block_(batch[i]);
+		batch[i]->lock_count++;
+	}
+	bm->flushing = true;
+	unlock_bm_(bm);
+
+	qsort(batch, nr, sizeof(*batch), cmp_block_);
+
+	start_prepare_(bm, nr);
+	for (i = 0, c = 0; i < nr; i += run) {
+		for (run = 1; i + run < nr && run < MAX_WRITE_RUN; run++)
+			if (batch[i + run]->b != batch[i]->b + run)
+				break;
+
+		for (; c * PREPARE_CHUNK < i + run; c++)
+			wait_prepared_(bm, c, nr);
+
+		write_run_(bm, batch + i, run);
+	}
+	end_prepare_(bm);
+
+	lock_bm_(bm);
+	for (i = 0; i < nr; i++) {
+		blk = batch[i];
+		blk->dirty = false;
+		if (!--blk->lock_count)
+			release_block_(blk);
+	}
+	bm->flushing = false;
+	pthread_cond_broadcast(&bm->unlocked);
+
+	// Includes any blocks written back when they were recycled.
+	seq = __atomic_load_n(&bm->write_seq, __ATOMIC_ACQUIRE);
+	unlock_bm_(bm);
+
+	return sync_to_(bm, seq);
+}
+
+/*
+ * Recycling a block may mean waiting for it to be written back, or for
+ * an earlier prefetch into it to finish.
+ */
+static bool recycle_blocks_(struct dm_block_manager *bm)
+{
+	struct dm_block *blk;
+
+	if (bm->nr_cached < bm->cache_size)
+		return false;
+
+	blk = peek_victim_(bm);
+	return blk && (blk->dirty || blk->io_pending);
+}
+
+// Called with @lock held.
+static void prefetch_(struct dm_block_manager *bm, dm_block_t b, bool may_block)
+{
+	int r;
+	struct dm_block *blk;
+	struct io_engine *e = bm->engine;
+
+	if (mapped_(bm)) {
+		madvise(bm->mapping + b * bm->block_size, bm->block_size, MADV_WILLNEED);
+		return;
+	}
+
+	// Recycling may drop @lock, so we check again each time round.
+	do {
+		if (!e || bm->reaping || lookup_block_(bm, b) ||
+		    bm->nr_in_flight >= e->max_io(e))
+			return;
+
+		if (!may_block && recycle_blocks_(bm))
+			return;
+
+		r = get_free_block_(bm, b, NULL, &blk);
+	} while (r == -EAGAIN);
+
+	if (r)
+		return;
+
+	blk->io_pending = true;
+	blk->prefetched = true;
+	if (e->issue(e, DIR_READ, bm->bdev->fd, (off_t) b * bm->block_size,
+		     blk->data, bm->block_size, blk)) {
+		bm->nr_in_flight++;
+		stats_(bm)->prefetches_issued++;
+		stats_(bm)->bytes_read += bm->block_size;
+	} else {
+		blk->io_pending = false;
+		blk->io_error = -EIO;
+	}
+
+	index_insert_(&bm->index, blk);
+	list_add(&blk->list, &bm->lru);
+}
+
+void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b)
+{
+	if (b >= bm->nr_blocks)
+		return;
+
+	lock_bm_(bm);
+	prefetch_(bm, b, true);
+	unlock_bm_(bm);
+}
+
+void dm_bm_set_flush_threads(struct dm_block_manager *bm, unsigned nr_threads)
+{
+	unsigned i;
+	struct flush_workers *w = &bm->workers;
+
+	if (mapped_(bm))
+		return;
+
+	// Holding the bm lock, with no flush in progress, keeps flush out.
+	lock_bm_(bm);
+	while (bm->flushing)
+		pthread_cond_wait(&bm->unlocked, &bm->lock);
+	stop_flush_threads_(bm);
+
+	nr_threads = min(nr_threads, MAX_FLUSH_THREADS);
+	w->threads = calloc(nr_threads, sizeof(*w->threads));
+	if (w->threads)
+		for (i = 0; i < nr_threads; i++) {
+			if (pthread_create(w->threads + i, NULL, flush_worker_, bm))
+				break;
+			w->nr_threads++;
+		}
+	unlock_bm_(bm);
+}
+
+void dm_bm_set_readahead(struct dm_block_manager *bm, unsigned nr_blocks)
+{
+	// mmap mode leaves readahead to the kernel.  Otherwise a long scan
+	// mustn't be able to flush the whole cache.
+	bm->readahead = mapped_(bm) ? 0 : min(nr_blocks, bm->cache_size / 4);
+}
+
+bool dm_bm_is_read_only(struct dm_block_manager *bm)
+{
+	return bm->read_only;
+}
+
+void dm_bm_set_read_only(struct dm_block_manager *bm)
+{
+	bm->read_only = true;
+}
+
+void dm_bm_set_read_write(struct dm_block_manager *bm)
+{
+	// The mapping is read only.
+	T_ASSERT(!mapped_(bm));
+	bm->read_only = false;
+}
+
+void dm_bm_get_stats(struct dm_block_manager *bm, struct dm_bm_stats *result)
+{
+	struct thread_state *ts;
+
+	pthread_mutex_lock(&bm->stats_lock);
+	*result = bm->exited_stats;
+	list_for_each_entry (ts, &bm->threads, list)
+		add_stats_(result, &ts->stats);
+	sub_stats_(result, &bm->base_stats);
+	pthread_mutex_unlock(&bm->stats_lock);
+}
+
+/*
+ * Other threads may be updating their counters, so rather than zero
+ * them we remember the current totals and subtract them from now on.
+ */
+void dm_bm_reset_stats(struct dm_block_manager *bm)
+{
+	struct thread_state *ts;
+
+	pthread_mutex_lock(&bm->stats_lock);
+	bm->base_stats = bm->exited_stats;
+	list_for_each_entry (ts, &bm->threads, list)
+		add_stats_(&bm->base_stats, &ts->stats);
+	pthread_mutex_unlock(&bm->stats_lock);
+}
+
+u32 dm_bm_checksum(const void *buf, size_t size, u32 crc)
+{
+	return crc32c(crc, buf, size);
 }
 
 /*----------------------------------------------------------------*/
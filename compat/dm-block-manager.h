@@ -7,6 +7,7 @@
 #ifndef _LINUX_DM_BLOCK_MANAGER_H
 #define _LINUX_DM_BLOCK_MANAGER_H
 
+#include "block-device.h"
 #include "types.h"
 
 #include <stdbool.h>
@@ -16,10 +17,6 @@
 
 /*----------------------------------------------------------------*/
 
-struct block_device {
-	FILE *file;
-};
-
 /*
  * Block number.
  */
@@ -36,12 +33,35 @@ void *dm_block_data(struct dm_block *b);
  * than 32 chars.
  *
  * @max_held_per_thread should be the maximum number of locks, read or
- * write, that an individual thread holds at any one time.
+ * write, that an individual thread holds at any one time.  Locks beyond
+ * that fail with -EINVAL.
+ *
+ * @cache_size is the maximum number of blocks kept in memory, including
+ * the held ones.  It's raised to @max_held_per_thread if smaller.  The
+ * buffers for them are allocated up front.
+ *
+ * Buffers are page aligned, so a file @bdev may be opened with O_DIRECT
+ * as long as @block_size is a multiple of the device's logical block
+ * size.  That saves the data being cached twice.
  */
 struct dm_block_manager;
 struct dm_block_manager *dm_block_manager_create(
+	struct block_device *bdev, unsigned block_size,
+	unsigned max_held_per_thread, unsigned cache_size);
+
+/*
+ * A read only bm for tools that scan metadata without changing it.  The
+ * whole device is mmapped (or for a RAM disk, referenced directly) and
+ * blocks point straight into the mapping, so the page cache is the only
+ * cache and nothing is copied.  Each block is validated the first time
+ * it's locked with a given validator.
+ *
+ * The bm can't be switched to read/write mode.
+ */
+struct dm_block_manager *dm_block_manager_create_mmap(
 	struct block_device *bdev, unsigned block_size,
 	unsigned max_held_per_thread);
+
 void dm_block_manager_destroy(struct dm_block_manager *bm);
 
 unsigned dm_bm_block_size(struct dm_block_manager *bm);
@@ -49,6 +69,22 @@ dm_block_t dm_bm_nr_blocks(struct dm_block_manager *bm);
 
 /*----------------------------------------------------------------*/
 
+/*
+ * What a block holds.  Blocks near the top of a structure are touched by
+ * nearly every operation, so the cache works harder to keep them, and
+ * the stats are broken down by class.
+ */
+enum dm_block_class {
+	DM_BLOCK_OTHER,
+	DM_BLOCK_BTREE_INTERNAL,
+	DM_BLOCK_BTREE_LEAF,
+	DM_BLOCK_SM_INDEX,
+	DM_BLOCK_SM_BITMAP,
+	DM_BLOCK_ARRAY,
+
+	DM_BLOCK_NR_CLASSES
+};
+
 /*
  * The validator allows the caller to verify newly-read data and modify
  * the data just before writing, e.g. to calculate checksums.  It's
@@ -63,6 +99,13 @@ struct dm_block_validator {
 	 * Return 0 if the checksum is valid or < 0 on error.
 	 */
 	int (*check)(struct dm_block_validator *v, struct dm_block *b, size_t block_size);
+
+	/*
+	 * Optional.  Called once a block has passed check(), and whenever a
+	 * write lock is dropped.  Blocks without one are DM_BLOCK_OTHER.
+	 */
+	enum dm_block_class (*classify)(struct dm_block_validator *v, struct dm_block *b,
+					size_t block_size);
 };
 
 /*----------------------------------------------------------------*/
@@ -70,6 +113,11 @@ struct dm_block_validator {
 /*
  * You can have multiple concurrent readers or a single writer holding a
  * block lock.
+ *
+ * A bm may be shared between threads, but every lock and unlock takes a
+ * single bm wide mutex.  Io is done with it dropped, so threads only
+ * wait for io on the blocks they want, but the rate of lookups on cached
+ * blocks won't grow with the number of cores.
  */
 
 /*
@@ -77,6 +125,7 @@ struct dm_block_validator {
  * memory that holds a copy of that block.  If you have write-locked the
  * block then any changes you make to memory pointed to by @result will be
  * written back to the disk sometime after dm_bm_unlock is called.
+ * Blocks past the end of the device fail with -EINVAL.
  */
 int dm_bm_read_lock(struct dm_block_manager *bm, dm_block_t b,
 		    struct dm_block_validator *v,
@@ -87,8 +136,10 @@ int dm_bm_write_lock(struct dm_block_manager *bm, dm_block_t b,
 		     struct dm_block **result);
 
 /*
- * The *_try_lock variants return -EWOULDBLOCK if the block isn't
- * available immediately.
+ * The *_try_lock variants return -EWOULDBLOCK rather than wait for io
+ * or another thread's write lock.  A block that isn't cached is
+ * prefetched, so retrying later, or falling back to a blocking lock,
+ * is cheaper.
  */
 int dm_bm_read_try_lock(struct dm_block_manager *bm, dm_block_t b,
 			struct dm_block_validator *v,
@@ -102,14 +153,34 @@ int dm_bm_write_lock_zero(struct dm_block_manager *bm, dm_block_t b,
 			  struct dm_block_validator *v,
 			  struct dm_block **result);
 
+/*
+ * Write locks @new with the contents of @old by handing @old's cached
+ * buffer over to it, saving a copy.  @old is dropped from the cache but
+ * left as it was on disk.  This is only possible if @old is cached,
+ * unlocked, clean and was checked with @v; otherwise -ENODATA is
+ * returned, nothing is changed, and the caller should copy instead.
+ */
+int dm_bm_write_lock_move(struct dm_block_manager *bm, dm_block_t old, dm_block_t new,
+			  struct dm_block_validator *v,
+			  struct dm_block **result);
+
 void dm_bm_unlock(struct dm_block *b);
 
 /*
- * It's a common idiom to have a superblock that should be committed last.
+ * All dirty blocks are guaranteed to be written and flushed before the
+ * superblock.  So flush, then update and unlock the superblock, then
+ * flush again.  Flush writes every block that has been unlocked dirty,
+ * including those read locked since, then issues a barrier, so
+ * everything written so far is durable when it returns.
+ *
+ * Dirty blocks that another thread has write locked are waited for,
+ * unless the caller holds locks of its own, which could deadlock.  Then,
+ * or if the caller has a dirty block write locked itself, flush fails
+ * with -EBUSY without writing anything.
  *
- * @superblock should be write-locked on entry. It will be unlocked during
- * this function.  All dirty blocks are guaranteed to be written and flushed
- * before the superblock.
+ * Threads that flush while a barrier is in progress wait and share the
+ * next one, so concurrent commits cost one barrier per group.  Once a
+ * barrier fails every later flush fails too.
  *
  * This method always blocks.
  */
@@ -120,6 +191,22 @@ int dm_bm_flush(struct dm_block_manager *bm);
  */
 void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b);
 
+/*
+ * When a thread locks blocks in ascending order the bm prefetches the
+ * next @nr_blocks automatically.  0 turns this off.  The window is
+ * capped at a quarter of the cache, and readahead is always off in mmap
+ * mode, where the kernel does its own.
+ */
+void dm_bm_set_readahead(struct dm_block_manager *bm, unsigned nr_blocks);
+
+/*
+ * Threads that run the validators' prepare_for_write in parallel at
+ * flush, while earlier blocks are being written.  0 leaves it all to
+ * the flushing thread.  Defaults to one less than the number of cpus.
+ * Has no effect in mmap mode.
+ */
+void dm_bm_set_flush_threads(struct dm_block_manager *bm, unsigned nr_threads);
+
 /*
  * Switches the bm to a read only mode.  Once read-only mode
  * has been entered the following functions will return -EPERM.
@@ -135,6 +222,64 @@ bool dm_bm_is_read_only(struct dm_block_manager *bm);
 void dm_bm_set_read_only(struct dm_block_manager *bm);
 void dm_bm_set_read_write(struct dm_block_manager *bm);
 
+/*----------------------------------------------------------------*/
+
+/*
+ * Counters of what the bm has done since it was created, or since the
+ * last dm_bm_reset_stats().  Each thread counts for itself, so updating
+ * them is cheap; dm_bm_get_stats() adds them up.
+ *
+ * Use dm_tm_get_bm() to get at these from the btree and space map
+ * layers.
+ */
+struct dm_bm_stats {
+	u64 read_locks;
+	u64 write_locks;
+	u64 zero_locks;
+
+	// dm_bm_write_lock_move() calls that moved a buffer.
+	u64 moves;
+
+	// Read and write locks that found the block cached, or had to read it.
+	u64 hits;
+	u64 misses;
+
+	u64 bytes_read;
+	u64 bytes_written;
+
+	// Write ios.  Flush writes runs of adjacent blocks with one each.
+	u64 writes;
+
+	u64 validation_failures;
+
+	// Time spent in the validators' check and prepare_for_write methods.
+	u64 checksum_ns;
+
+	u64 flushes;
+
+	// Device syncs issued by flushes.  Fewer than flushes when
+	// concurrent flushes have been grouped together.
+	u64 barriers;
+
+	// Blocks read by dm_bm_prefetch(), and how many of them were later locked.
+	u64 prefetches_issued;
+	u64 prefetches_used;
+
+	// dm_bm_read_try_lock() calls that returned -EWOULDBLOCK.
+	u64 would_blocks;
+
+	// hits and misses again, by the class of the block.
+	struct {
+		u64 hits;
+		u64 misses;
+	} classes[DM_BLOCK_NR_CLASSES];
+};
+
+void dm_bm_get_stats(struct dm_block_manager *bm, struct dm_bm_stats *result);
+void dm_bm_reset_stats(struct dm_block_manager *bm);
+
+/*----------------------------------------------------------------*/
+
 u32 dm_bm_checksum(const void *data, size_t len, u32 init_xor);
 
 /*----------------------------------------------------------------*/
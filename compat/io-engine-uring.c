@@ -0,0 +1,243 @@
+#include "io-engine.h"
+
+/*
+ * The kernel's uapi headers clash with the compat ones (they share
+ * include guards), so this engine lives in its own file and sticks to
+ * system headers.
+ */
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*----------------------------------------------------------------
+ * io_uring engine
+ *
+ * We talk to the kernel directly rather than pulling in liburing.
+ *--------------------------------------------------------------*/
+
+struct uring_cb {
+	struct uring_cb *next_free;
+	size_t len;
+	void *context;
+};
+
+struct uring_engine {
+	struct io_engine e;
+
+	int fd;
+	unsigned depth;
+	unsigned nr_in_flight;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_cb *cbs;
+	struct uring_cb *free_cbs;
+};
+
+static struct uring_engine *to_uring(struct io_engine *e)
+{
+	return (struct uring_engine *) e;
+}
+
+static int uring_setup_(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter_(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap_(struct uring_engine *u)
+{
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->cq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+}
+
+static void uring_destroy_(struct io_engine *e)
+{
+	struct uring_engine *u = to_uring(e);
+
+	while (e->wait(e, NULL))
+		;
+
+	uring_unmap_(u);
+	close(u->fd);
+	free(u->cbs);
+	free(u);
+}
+
+static bool uring_issue_(struct io_engine *e, enum dir d, int fd,
+			 off_t offset, void *data, size_t len, void *context)
+{
+	struct uring_engine *u = to_uring(e);
+	struct io_uring_sqe *sqe;
+	struct uring_cb *cb;
+	unsigned tail, index;
+
+	cb = u->free_cbs;
+	if (!cb)
+		return false;
+
+	tail = *u->sq_tail;
+	index = tail & *u->sq_mask;
+	sqe = u->sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (d == DIR_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t) data;
+	sqe->len = len;
+	sqe->user_data = (uintptr_t) cb;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (uring_enter_(u->fd, 1, 0, 0) != 1) {
+		// Take the sqe back.
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	u->free_cbs = cb->next_free;
+	cb->len = len;
+	cb->context = context;
+	u->nr_in_flight++;
+
+	return true;
+}
+
+static unsigned uring_reap_(struct uring_engine *u, io_complete_fn fn)
+{
+	unsigned head = *u->cq_head, count = 0;
+	struct io_uring_cqe *cqe;
+	struct uring_cb *cb;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = u->cqes + (head & *u->cq_mask);
+		cb = (struct uring_cb *) (uintptr_t) cqe->user_data;
+
+		if (fn)
+			fn(cb->context, io_result(cqe->res, cb->len));
+
+		cb->next_free = u->free_cbs;
+		u->free_cbs = cb;
+		u->nr_in_flight--;
+
+		head++;
+		count++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static bool uring_wait_(struct io_engine *e, io_complete_fn fn)
+{
+	struct uring_engine *u = to_uring(e);
+
+	if (!u->nr_in_flight)
+		return false;
+
+	// Interrupted or short of resources, we just try again.
+	while (!uring_reap_(u, fn))
+		if (uring_enter_(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR && errno != EAGAIN)
+			return false;
+
+	return true;
+}
+
+static unsigned uring_max_io_(struct io_engine *e)
+{
+	return to_uring(e)->depth;
+}
+
+static void *map_ring_(int fd, size_t len, off_t offset)
+{
+	void *r = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return r == MAP_FAILED ? NULL : r;
+}
+
+struct io_engine *create_uring_io_engine(unsigned queue_depth)
+{
+	unsigned i;
+	struct io_uring_params p;
+	struct uring_engine *u = calloc(1, sizeof(*u));
+
+	if (!u)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = uring_setup_(queue_depth, &p);
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->depth = p.sq_entries;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->sq_ring = map_ring_(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->cq_ring = map_ring_(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = map_ring_(u->fd, u->sqes_size, IORING_OFF_SQES);
+	u->cbs = calloc(u->depth, sizeof(*u->cbs));
+
+	if (!u->sq_ring || !u->cq_ring || !u->sqes || !u->cbs) {
+		uring_unmap_(u);
+		close(u->fd);
+		free(u->cbs);
+		free(u);
+		return NULL;
+	}
+
+	u->sq_head = u->sq_ring + p.sq_off.head;
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+
+	u->free_cbs = NULL;
+	for (i = 0; i < u->depth; i++) {
+		u->cbs[i].next_free = u->free_cbs;
+		u->free_cbs = u->cbs + i;
+	}
+
+	u->e.destroy = uring_destroy_;
+	u->e.issue = uring_issue_;
+	u->e.wait = uring_wait_;
+	u->e.max_io = uring_max_io_;
+
+	return &u->e;
+}
+
+/*----------------------------------------------------------------*/
@@ -0,0 +1,264 @@
+#include "io-engine.h"
+#include "list.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*----------------------------------------------------------------*/
+
+int io_result(ssize_t r, size_t len)
+{
+	if (r < 0)
+		return r;
+
+	return (size_t) r == len ? 0 : -EIO;
+}
+
+/*----------------------------------------------------------------
+ * Thread pool engine
+ *
+ * Worker threads do synchronous io, with pread/pwrite unless the
+ * caller supplies its own function.  Only the submission and
+ * completion queues are shared with them.
+ *--------------------------------------------------------------*/
+
+struct thread_io {
+	struct list_head list;
+
+	enum dir d;
+	int fd;
+	off_t offset;
+	void *data;
+	size_t len;
+	void *context;
+	int error;
+};
+
+struct thread_engine {
+	struct io_engine e;
+
+	sync_io_fn *fn;
+	void *fn_context;
+
+	unsigned depth;
+	unsigned nr_in_flight;
+	unsigned nr_threads;
+	pthread_t *threads;
+
+	struct thread_io *ios;
+	struct list_head free;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_queued;
+	pthread_cond_t work_completed;
+	struct list_head queued;
+	struct list_head completed;
+	bool stopping;
+};
+
+static struct thread_engine *to_thread(struct io_engine *e)
+{
+	return container_of(e, struct thread_engine, e);
+}
+
+static int pio_(void *context, enum dir d, int fd, off_t offset, void *data, size_t len)
+{
+	ssize_t r;
+
+	if (d == DIR_READ)
+		r = pread(fd, data, len, offset);
+	else
+		r = pwrite(fd, data, len, offset);
+
+	return io_result(r < 0 ? -errno : r, len);
+}
+
+static void *worker_(void *context)
+{
+	struct thread_engine *t = context;
+	struct thread_io *io;
+
+	pthread_mutex_lock(&t->lock);
+	for (;;) {
+		while (list_empty(&t->queued) && !t->stopping)
+			pthread_cond_wait(&t->work_queued, &t->lock);
+
+		if (list_empty(&t->queued))
+			break;
+
+		io = list_first_entry(&t->queued, struct thread_io, list);
+		list_del(&io->list);
+		pthread_mutex_unlock(&t->lock);
+
+		io->error = t->fn(t->fn_context, io->d, io->fd, io->offset, io->data, io->len);
+
+		pthread_mutex_lock(&t->lock);
+		list_add_tail(&io->list, &t->completed);
+		pthread_cond_signal(&t->work_completed);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+static void thread_stop_(struct thread_engine *t, unsigned nr_started)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&t->lock);
+	t->stopping = true;
+	pthread_cond_broadcast(&t->work_queued);
+	pthread_mutex_unlock(&t->lock);
+
+	for (i = 0; i < nr_started; i++)
+		pthread_join(t->threads[i], NULL);
+}
+
+static void thread_free_(struct thread_engine *t)
+{
+	pthread_cond_destroy(&t->work_completed);
+	pthread_cond_destroy(&t->work_queued);
+	pthread_mutex_destroy(&t->lock);
+	free(t->ios);
+	free(t->threads);
+	free(t);
+}
+
+static void thread_destroy_(struct io_engine *e)
+{
+	struct thread_engine *t = to_thread(e);
+
+	while (e->wait(e, NULL))
+		;
+
+	thread_stop_(t, t->nr_threads);
+	thread_free_(t);
+}
+
+static bool thread_issue_(struct io_engine *e, enum dir d, int fd,
+			  off_t offset, void *data, size_t len, void *context)
+{
+	struct thread_engine *t = to_thread(e);
+	struct thread_io *io;
+
+	if (list_empty(&t->free))
+		return false;
+
+	io = list_first_entry(&t->free, struct thread_io, list);
+	list_del(&io->list);
+
+	io->d = d;
+	io->fd = fd;
+	io->offset = offset;
+	io->data = data;
+	io->len = len;
+	io->context = context;
+	t->nr_in_flight++;
+
+	pthread_mutex_lock(&t->lock);
+	list_add_tail(&io->list, &t->queued);
+	pthread_cond_signal(&t->work_queued);
+	pthread_mutex_unlock(&t->lock);
+
+	return true;
+}
+
+static bool thread_wait_(struct io_engine *e, io_complete_fn fn)
+{
+	struct thread_engine *t = to_thread(e);
+	struct thread_io *io, *tmp;
+	LIST_HEAD(done);
+
+	if (!t->nr_in_flight)
+		return false;
+
+	pthread_mutex_lock(&t->lock);
+	while (list_empty(&t->completed))
+		pthread_cond_wait(&t->work_completed, &t->lock);
+	list_splice_init(&t->completed, &done);
+	pthread_mutex_unlock(&t->lock);
+
+	list_for_each_entry_safe (io, tmp, &done, list) {
+		if (fn)
+			fn(io->context, io->error);
+
+		list_move(&io->list, &t->free);
+		t->nr_in_flight--;
+	}
+
+	return true;
+}
+
+static unsigned thread_max_io_(struct io_engine *e)
+{
+	return to_thread(e)->depth;
+}
+
+struct io_engine *create_sync_io_engine(unsigned nr_threads, unsigned queue_depth,
+				       sync_io_fn fn, void *context)
+{
+	unsigned i;
+	struct thread_engine *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+
+	t->fn = fn;
+	t->fn_context = context;
+	t->depth = queue_depth;
+	t->nr_threads = nr_threads;
+	t->threads = calloc(nr_threads, sizeof(*t->threads));
+	t->ios = calloc(queue_depth, sizeof(*t->ios));
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->work_queued, NULL);
+	pthread_cond_init(&t->work_completed, NULL);
+	INIT_LIST_HEAD(&t->free);
+	INIT_LIST_HEAD(&t->queued);
+	INIT_LIST_HEAD(&t->completed);
+
+	if (!t->threads || !t->ios) {
+		thread_free_(t);
+		return NULL;
+	}
+
+	for (i = 0; i < queue_depth; i++)
+		list_add(&t->ios[i].list, &t->free);
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(t->threads + i, NULL, worker_, t)) {
+			thread_stop_(t, i);
+			thread_free_(t);
+			return NULL;
+		}
+
+	t->e.destroy = thread_destroy_;
+	t->e.issue = thread_issue_;
+	t->e.wait = thread_wait_;
+	t->e.max_io = thread_max_io_;
+
+	return &t->e;
+}
+
+struct io_engine *create_thread_io_engine(unsigned nr_threads, unsigned queue_depth)
+{
+	return create_sync_io_engine(nr_threads, queue_depth, pio_, NULL);
+}
+
+/*----------------------------------------------------------------*/
+
+#define NR_IO_THREADS 4
+
+struct io_engine *create_async_io_engine(unsigned queue_depth)
+{
+	struct io_engine *e = create_uring_io_engine(queue_depth);
+
+	if (!e)
+		e = create_thread_io_engine(NR_IO_THREADS, queue_depth);
+
+	return e;
+}
+
+/*----------------------------------------------------------------*/
@@ -0,0 +1,61 @@
+#ifndef compat_io_engine_h_INCLUDED
+#define compat_io_engine_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * An io engine submits reads and writes asynchronously.  Completions are
+ * only delivered from within wait(), on the calling thread, so the
+ * caller never sees a callback at an unexpected time.
+ */
+enum dir {
+	DIR_READ,
+	DIR_WRITE
+};
+
+// io_error is 0 on success, or a -ve errno.  Short transfers are -EIO.
+typedef void io_complete_fn(void *context, int io_error);
+
+struct io_engine {
+	void (*destroy)(struct io_engine *e);
+
+	// Returns false if the io couldn't be queued.
+	bool (*issue)(struct io_engine *e, enum dir d, int fd,
+		      off_t offset, void *data, size_t len, void *context);
+
+	// Blocks until at least one io completes, then reaps everything
+	// that has completed.  Returns false if nothing is in flight.
+	bool (*wait)(struct io_engine *e, io_complete_fn fn);
+
+	// The most ios that may be in flight at once.
+	unsigned (*max_io)(struct io_engine *e);
+};
+
+struct io_engine *create_uring_io_engine(unsigned queue_depth);
+struct io_engine *create_thread_io_engine(unsigned nr_threads, unsigned queue_depth);
+
+/*
+ * Like the thread engine, but the workers call @fn rather than
+ * pread/pwrite.  For devices that aren't an fd.  @fn returns 0 or a -ve
+ * errno.
+ */
+typedef int sync_io_fn(void *context, enum dir d, int fd, off_t offset, void *data, size_t len);
+struct io_engine *create_sync_io_engine(unsigned nr_threads, unsigned queue_depth,
+				       sync_io_fn fn, void *context);
+
+// Converts a pread/pwrite style return value into an io_error.
+int io_result(ssize_t r, size_t len);
+
+/*
+ * Uses io_uring if the kernel supports it, falling back to a pool of
+ * threads doing synchronous io otherwise.
+ */
+struct io_engine *create_async_io_engine(unsigned queue_depth);
+
+/*----------------------------------------------------------------*/
+
+#endif
@@ -6,9 +6,9 @@
 #include "types.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 
-#define offsetof(TYPE, MEMBER)  ((size_t)&((TYPE *)0)->MEMBER)
 #define BUILD_BUG_ON_MSG(cond, msg) (msg)
 #define container_of(ptr, type, member) ({                              \
 	void *__mptr = (void *)(ptr);                                   \
@@ -29,6 +29,7 @@ enum {
 };
 
 static inline void *kmalloc(size_t s, int _) {return malloc(s);}
+static inline void *kzalloc(size_t s, int _) {return calloc(1, s);}
 static inline void kfree(void *ptr) {free(ptr);}
 
 static inline void *zalloc(size_t len) {
@@ -1,12 +1,26 @@
 #ifndef compat_mutex_h_INCLUDED
 #define compat_mutex_h_INCLUDED
 
+#include <pthread.h>
+
 struct mutex {
+	pthread_mutex_t m;
 };
 
-static inline void mutex_init(struct mutex *m) {}
-static inline void mutex_lock(struct mutex *m) {}
-static inline void mutex_unlock(struct mutex *m) {}
+static inline void mutex_init(struct mutex *m)
+{
+	pthread_mutex_init(&m->m, NULL);
+}
+
+static inline void mutex_lock(struct mutex *m)
+{
+	pthread_mutex_lock(&m->m);
+}
+
+static inline void mutex_unlock(struct mutex *m)
+{
+	pthread_mutex_unlock(&m->m);
+}
 
 #endif
 
@@ -0,0 +1,241 @@
+#include "sim-disk.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*----------------------------------------------------------------*/
+
+struct sim_disk {
+	struct block_device bdev;
+	struct block_device *inner;
+	struct sim_disk_config config;
+
+	pthread_mutex_t lock;
+	pthread_cond_t slot_free;
+	unsigned nr_active;
+	uint64_t rand_state;
+
+	// When the transfers already admitted will have finished.
+	uint64_t channel_free_ns;
+};
+
+static struct sim_disk *to_sim(struct block_device *bdev)
+{
+	return (struct sim_disk *) bdev;
+}
+
+static uint64_t now_ns_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// xorshift64*, in (0, 1].
+static double rand_(struct sim_disk *sd)
+{
+	uint64_t x = sd->rand_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sd->rand_state = x;
+
+	return ((x * 0x2545f4914f6cdd1dull >> 11) + 1) / 9007199254740992.0;
+}
+
+static uint64_t latency_(struct sim_disk *sd)
+{
+	struct sim_disk_config *c = &sd->config;
+	double ns;
+
+	switch (c->latency) {
+	case SIM_LATENCY_FIXED:
+		return c->latency_ns;
+
+	case SIM_LATENCY_UNIFORM:
+		return c->latency_ns + (c->max_latency_ns - c->latency_ns) * (1.0 - rand_(sd));
+
+	case SIM_LATENCY_TAIL:
+		ns = c->latency_ns * pow(rand_(sd), -1.0 / c->tail_shape);
+		return ns < c->max_latency_ns ? ns : c->max_latency_ns;
+	}
+
+	return 0;
+}
+
+/*
+ * Waits until an io of @len bytes, taking @extra_ns longer than usual,
+ * would have completed.  Pair with end_io_().
+ */
+static void begin_io_(struct sim_disk *sd, size_t len, uint64_t extra_ns)
+{
+	uint64_t now, done;
+	struct sim_disk_config *c = &sd->config;
+
+	pthread_mutex_lock(&sd->lock);
+	while (c->queue_depth && sd->nr_active >= c->queue_depth)
+		pthread_cond_wait(&sd->slot_free, &sd->lock);
+	sd->nr_active++;
+
+	now = now_ns_();
+	done = now + latency_(sd) + extra_ns;
+	if (c->bandwidth) {
+		if (sd->channel_free_ns > done)
+			done = sd->channel_free_ns;
+		done += (uint64_t) len * 1000000000 / c->bandwidth;
+		sd->channel_free_ns = done;
+	}
+	pthread_mutex_unlock(&sd->lock);
+
+	sleep_until_(done);
+}
+
+static void end_io_(struct sim_disk *sd)
+{
+	pthread_mutex_lock(&sd->lock);
+	sd->nr_active--;
+	pthread_cond_signal(&sd->slot_free);
+	pthread_mutex_unlock(&sd->lock);
+}
+
+/*----------------------------------------------------------------*/
+
+static int sim_read_(struct block_device *bdev, void *data, size_t len, off_t offset)
+{
+	int r;
+	struct sim_disk *sd = to_sim(bdev);
+
+	begin_io_(sd, len, 0);
+	r = bdev_read(sd->inner, data, len, offset);
+	end_io_(sd);
+
+	return r;
+}
+
+static int sim_writev_(struct block_device *bdev, const struct iovec *iov, unsigned nr, off_t offset)
+{
+	int r;
+	unsigned i;
+	size_t len = 0;
+	struct sim_disk *sd = to_sim(bdev);
+
+	for (i = 0; i < nr; i++)
+		len += iov[i].iov_len;
+
+	begin_io_(sd, len, 0);
+	r = bdev_writev(sd->inner, iov, nr, offset);
+	end_io_(sd);
+
+	return r;
+}
+
+static int sim_sync_(struct block_device *bdev)
+{
+	int r;
+	struct sim_disk *sd = to_sim(bdev);
+
+	begin_io_(sd, 0, sd->config.barrier_ns);
+	r = bdev_sync(sd->inner);
+	end_io_(sd);
+
+	return r;
+}
+
+static uint64_t sim_size_(struct block_device *bdev)
+{
+	struct sim_disk *sd = to_sim(bdev);
+	return sd->inner->ops->size(sd->inner);
+}
+
+static void *sim_map_(struct block_device *bdev, size_t len)
+{
+	return NULL;
+}
+
+static void sim_unmap_(struct block_device *bdev, void *mem, size_t len)
+{
+}
+
+static int sim_io_(void *context, enum dir d, int fd, off_t offset, void *data, size_t len)
+{
+	struct block_device *bdev = context;
+
+	if (d == DIR_READ)
+		return bdev_read(bdev, data, len, offset);
+	else
+		return bdev_write(bdev, data, len, offset);
+}
+
+// Async ios just block a worker each, so there's no point having more
+// workers than the device has queue slots.
+static struct io_engine *sim_create_engine_(struct block_device *bdev, unsigned queue_depth)
+{
+	struct sim_disk *sd = to_sim(bdev);
+	unsigned nr_threads = queue_depth;
+
+	if (sd->config.queue_depth && sd->config.queue_depth < nr_threads)
+		nr_threads = sd->config.queue_depth;
+
+	return create_sync_io_engine(nr_threads, queue_depth, sim_io_, bdev);
+}
+
+static const struct block_device_ops sim_ops = {
+	.read = sim_read_,
+	.writev = sim_writev_,
+	.sync = sim_sync_,
+	.size = sim_size_,
+	.map = sim_map_,
+	.unmap = sim_unmap_,
+	.create_engine = sim_create_engine_,
+};
+
+struct block_device *sim_disk_create(struct block_device *inner,
+				     const struct sim_disk_config *config)
+{
+	struct sim_disk *sd = malloc(sizeof(*sd));
+
+	if (!sd)
+		return NULL;
+
+	sd->bdev.ops = &sim_ops;
+	sd->bdev.fd = -1;
+	sd->inner = inner;
+	sd->config = *config;
+
+	pthread_mutex_init(&sd->lock, NULL);
+	pthread_cond_init(&sd->slot_free, NULL);
+	sd->nr_active = 0;
+	sd->channel_free_ns = 0;
+
+	// xorshift gets stuck on 0.
+	sd->rand_state = config->seed * 0x9e3779b97f4a7c15ull + 1;
+
+	return &sd->bdev;
+}
+
+void sim_disk_destroy(struct block_device *bdev)
+{
+	struct sim_disk *sd = to_sim(bdev);
+
+	pthread_cond_destroy(&sd->slot_free);
+	pthread_mutex_destroy(&sd->lock);
+	free(sd);
+}
+
+/*----------------------------------------------------------------*/
@@ -0,0 +1,65 @@
+#ifndef compat_sim_disk_h_INCLUDED
+#define compat_sim_disk_h_INCLUDED
+
+#include "block-device.h"
+
+#include <stdint.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * A simulated device wraps another one, usually a RAM disk, and makes
+ * every io take as long as it would on slow hardware.  Use it to see
+ * how caching, prefetch and write coalescing behave against a slow
+ * metadata device without needing one.
+ *
+ * Each io waits for a queue slot, then for its latency, then for its
+ * share of the bandwidth, and only then is passed to the inner device.
+ * Latencies come from a seeded generator, so a single threaded run
+ * sees the same sequence every time.
+ */
+enum sim_latency {
+	// Always @latency_ns.
+	SIM_LATENCY_FIXED,
+
+	// Uniform between @latency_ns and @max_latency_ns.
+	SIM_LATENCY_UNIFORM,
+
+	// Pareto, starting at @latency_ns and capped at @max_latency_ns.
+	// Most ios are near the minimum but a few take far longer.  The
+	// smaller @tail_shape the heavier the tail; 1.0 - 2.0 is typical.
+	SIM_LATENCY_TAIL,
+};
+
+struct sim_disk_config {
+	enum sim_latency latency;
+	uint64_t latency_ns;
+	uint64_t max_latency_ns;
+	double tail_shape;
+
+	// The most ios serviced at once.  0 for no limit.
+	unsigned queue_depth;
+
+	// Bytes per second, shared by reads and writes.  0 for no limit.
+	uint64_t bandwidth;
+
+	// How much longer than other ios a sync takes.  Flushing a drive's
+	// write cache is usually the slowest thing it does.
+	uint64_t barrier_ns;
+
+	unsigned seed;
+};
+
+/*
+ * @inner must outlive the sim disk, and is still owned by the caller.
+ *
+ * There's no way to slow down page faults, so a sim disk can't be used
+ * by an mmap mode bm.
+ */
+struct block_device *sim_disk_create(struct block_device *inner,
+				     const struct sim_disk_config *config);
+void sim_disk_destroy(struct block_device *bdev);
+
+/*----------------------------------------------------------------*/
+
+#endif
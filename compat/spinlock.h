@@ -1,14 +1,28 @@
 #ifndef compat_spinlock_h_INCLUDED
 #define compat_spinlock_h_INCLUDED
 
+#include <pthread.h>
+
 struct spinlock {
+	pthread_spinlock_t s;
 };
 
 typedef struct spinlock spinlock_t;
 
-static inline void spin_lock_init(spinlock_t *s) {}
-static inline void spin_lock(spinlock_t *s) {}
-static inline void spin_unlock(spinlock_t *s) {}
+static inline void spin_lock_init(spinlock_t *s)
+{
+	pthread_spin_init(&s->s, PTHREAD_PROCESS_PRIVATE);
+}
+
+static inline void spin_lock(spinlock_t *s)
+{
+	pthread_spin_lock(&s->s);
+}
+
+static inline void spin_unlock(spinlock_t *s)
+{
+	pthread_spin_unlock(&s->s);
+}
 
 #endif
 
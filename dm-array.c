@@ -76,10 +76,18 @@ static int array_block_check(struct dm_block_validator *v,
 	return 0;
 }
 
+static enum dm_block_class array_block_classify(struct dm_block_validator *v,
+						struct dm_block *b,
+						size_t size_of_block)
+{
+	return DM_BLOCK_ARRAY;
+}
+
 static struct dm_block_validator array_validator = {
 	.name = "array",
 	.prepare_for_write = array_block_prepare_for_write,
-	.check = array_block_check
+	.check = array_block_check,
+	.classify = array_block_classify
 };
 
 /*----------------------------------------------------------------*/
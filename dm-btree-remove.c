@@ -163,8 +163,13 @@ static int init_child(struct dm_btree_info *info, struct dm_btree_value_type *vt
 
 	result->n = dm_block_data(result->block);
 
-	if (inc)
-		inc_children(info->tm, result->n, vt);
+	if (inc) {
+		r = inc_children(info->tm, result->n, vt);
+		if (r) {
+			dm_tm_unlock(info->tm, result->block);
+			return r;
+		}
+	}
 
 	*((__le64 *) value_ptr(parent, index)) =
 		cpu_to_le64(dm_block_location(result->block));
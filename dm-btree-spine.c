@@ -89,10 +89,21 @@ static int node_check(struct dm_block_validator *v,
 	return 0;
 }
 
+static enum dm_block_class node_classify(struct dm_block_validator *v,
+					 struct dm_block *b,
+					 size_t block_size)
+{
+	struct btree_node *n = dm_block_data(b);
+
+	return (le32_to_cpu(n->header.flags) & INTERNAL_NODE) ?
+		DM_BLOCK_BTREE_INTERNAL : DM_BLOCK_BTREE_LEAF;
+}
+
 struct dm_block_validator btree_node_validator = {
 	.name = "btree_node",
 	.prepare_for_write = node_prepare_for_write,
-	.check = node_check
+	.check = node_check,
+	.classify = node_classify
 };
 
 /*----------------------------------------------------------------*/
@@ -111,8 +122,12 @@ static int bn_shadow(struct dm_btree_info *info, dm_block_t orig,
 
 	r = dm_tm_shadow_block(info->tm, orig, &btree_node_validator,
 			       result, &inc);
-	if (!r && inc)
-		inc_children(info->tm, dm_block_data(*result), vt);
+	if (r || !inc)
+		return r;
+
+	r = inc_children(info->tm, dm_block_data(*result), vt);
+	if (r)
+		dm_tm_unlock(info->tm, *result);
 
 	return r;
 }
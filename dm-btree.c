@@ -71,18 +71,39 @@ static int upper_bound(struct btree_node *n, uint64_t key)
 	return bsearch_(n, key, 1);
 }
 
-void inc_children(struct dm_transaction_manager *tm, struct btree_node *n,
-		  struct dm_btree_value_type *vt)
+/*
+ * Children are incremented in batches, so the space map can update each
+ * bitmap once per batch rather than once per child.
+ */
+#define INC_BATCH 64
+
+int inc_children(struct dm_transaction_manager *tm, struct btree_node *n,
+		 struct dm_btree_value_type *vt)
 {
-	unsigned i;
+	int r;
+	unsigned i, nr = 0;
 	uint32_t nr_entries = le32_to_cpu(n->header.nr_entries);
+	dm_block_t batch[INC_BATCH];
+
+	if (le32_to_cpu(n->header.flags) & INTERNAL_NODE) {
+		for (i = 0; i < nr_entries; i++) {
+			batch[nr++] = value64(n, i);
+			if (nr == INC_BATCH) {
+				r = dm_tm_inc_many(tm, batch, nr);
+				if (r)
+					return r;
+				nr = 0;
+			}
+		}
 
-	if (le32_to_cpu(n->header.flags) & INTERNAL_NODE)
-		for (i = 0; i < nr_entries; i++)
-			dm_tm_inc(tm, value64(n, i));
-	else if (vt->inc)
+		if (nr)
+			return dm_tm_inc_many(tm, batch, nr);
+
+	} else if (vt->inc)
 		for (i = 0; i < nr_entries; i++)
 			vt->inc(vt->context, value_ptr(n, i));
+
+	return 0;
 }
 
 static int insert_at(size_t value_size, struct btree_node *node, unsigned index,
@@ -13,6 +13,7 @@
 #include "compat/cmp.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define DM_MSG_PREFIX "space map common"
@@ -61,10 +62,18 @@ static int index_check(struct dm_block_validator *v,
 	return 0;
 }
 
+static enum dm_block_class index_classify(struct dm_block_validator *v,
+					  struct dm_block *b,
+					  size_t block_size)
+{
+	return DM_BLOCK_SM_INDEX;
+}
+
 static struct dm_block_validator index_validator = {
 	.name = "index",
 	.prepare_for_write = index_prepare_for_write,
-	.check = index_check
+	.check = index_check,
+	.classify = index_classify
 };
 
 /*----------------------------------------------------------------*/
@@ -111,10 +120,18 @@ static int dm_bitmap_check(struct dm_block_validator *v,
 	return 0;
 }
 
+static enum dm_block_class dm_bitmap_classify(struct dm_block_validator *v,
+					      struct dm_block *b,
+					      size_t block_size)
+{
+	return DM_BLOCK_SM_BITMAP;
+}
+
 static struct dm_block_validator dm_sm_bitmap_validator = {
 	.name = "sm_bitmap",
 	.prepare_for_write = dm_bitmap_prepare_for_write,
 	.check = dm_bitmap_check,
+	.classify = dm_bitmap_classify,
 };
 
 /*----------------------------------------------------------------*/
@@ -460,14 +477,14 @@ static int sm_ll_mutate(struct ll_disk *ll, dm_block_t b,
 	if (ref_count && !old) {
 		*ev = SM_ALLOC;
 		ll->nr_allocated++;
-		le32_add_cpu(&ie_disk.nr_free, -1);
+		ie_disk.nr_free = cpu_to_le32(le32_to_cpu(ie_disk.nr_free) - 1);
 		if (le32_to_cpu(ie_disk.none_free_before) == bit)
 			ie_disk.none_free_before = cpu_to_le32(bit + 1);
 
 	} else if (old && !ref_count) {
 		*ev = SM_FREE;
 		ll->nr_allocated--;
-		le32_add_cpu(&ie_disk.nr_free, 1);
+		ie_disk.nr_free = cpu_to_le32(le32_to_cpu(ie_disk.nr_free) + 1);
 		ie_disk.none_free_before = cpu_to_le32(min(le32_to_cpu(ie_disk.none_free_before), bit));
 	} else
 		*ev = SM_NONE;
@@ -498,6 +515,141 @@ int sm_ll_inc(struct ll_disk *ll, dm_block_t b, enum allocation_event *ev)
 	return sm_ll_mutate(ll, b, inc_ref_count, NULL, ev);
 }
 
+static int cmp_block(const void *lhs, const void *rhs)
+{
+	dm_block_t l = *((dm_block_t *) lhs);
+	dm_block_t r = *((dm_block_t *) rhs);
+
+	return l < r ? -1 : l > r;
+}
+
+static int shadow_bitmap(struct ll_disk *ll, struct disk_index_entry *ie_disk,
+			 struct dm_block **result)
+{
+	int r, inc;
+
+	r = dm_tm_shadow_block(ll->tm, le64_to_cpu(ie_disk->blocknr),
+			       &dm_sm_bitmap_validator, result, &inc);
+	if (r < 0) {
+		DMERR("dm_tm_shadow_block() failed");
+		return r;
+	}
+	ie_disk->blocknr = cpu_to_le64(dm_block_location(*result));
+
+	return 0;
+}
+
+/*
+ * Increments the leading run of @blocks that fall in the same bitmap,
+ * with one shadow of the bitmap and one update of its index entry.
+ * Returns the length of the run through @nr_done.  If one of them fails
+ * the index entry is still updated for those before it.
+ */
+static int sm_ll_inc_bitmap(struct ll_disk *ll, dm_block_t *blocks, unsigned nr,
+			    unsigned *nr_done, int32_t *nr_allocations)
+{
+	int r, r2;
+	bool locked;
+	unsigned i;
+	uint32_t bit, old;
+	struct dm_block *nb;
+	dm_block_t b, index = blocks[0];
+	struct disk_index_entry ie_disk;
+	void *bm_le;
+
+	do_div(index, ll->entries_per_block);
+	r = ll->load_ie(ll, index, &ie_disk);
+	if (r < 0)
+		return r;
+
+	r = shadow_bitmap(ll, &ie_disk, &nb);
+	if (r < 0)
+		return r;
+	locked = true;
+	bm_le = dm_bitmap_data(nb);
+
+	for (i = 0; i < nr; i++) {
+		b = blocks[i];
+		bit = do_div(b, ll->entries_per_block);
+		if (b != index)
+			break;
+
+		b = blocks[i];
+		old = sm_lookup_bitmap(bm_le, bit);
+		if (old > 2) {
+			r = sm_ll_lookup_big_ref_count(ll, b, &old);
+			if (r < 0)
+				break;
+		}
+
+		if (old < 2)
+			sm_set_bitmap(bm_le, bit, old + 1);
+
+		else {
+			__le32 le_rc = cpu_to_le32(old + 1);
+
+			/*
+			 * Like sm_ll_mutate() we don't hold the bitmap over
+			 * the btree insert.  Relocking it afterwards is cheap
+			 * since it's already been shadowed.
+			 */
+			sm_set_bitmap(bm_le, bit, 3);
+			dm_tm_unlock(ll->tm, nb);
+			locked = false;
+
+			__dm_bless_for_disk(&le_rc);
+			r = dm_btree_insert(&ll->ref_count_info, ll->ref_count_root,
+					    &b, &le_rc, &ll->ref_count_root);
+			if (r < 0) {
+				DMERR("ref count insert failed");
+				break;
+			}
+
+			r = shadow_bitmap(ll, &ie_disk, &nb);
+			if (r < 0)
+				break;
+			locked = true;
+			bm_le = dm_bitmap_data(nb);
+		}
+
+		if (!old) {
+			(*nr_allocations)++;
+			ll->nr_allocated++;
+			ie_disk.nr_free = cpu_to_le32(le32_to_cpu(ie_disk.nr_free) - 1);
+			if (le32_to_cpu(ie_disk.none_free_before) == bit)
+				ie_disk.none_free_before = cpu_to_le32(bit + 1);
+		}
+	}
+
+	if (locked)
+		dm_tm_unlock(ll->tm, nb);
+	*nr_done = i;
+
+	r2 = ll->save_ie(ll, index, &ie_disk);
+	return r < 0 ? r : r2;
+}
+
+int sm_ll_inc_many(struct ll_disk *ll, dm_block_t *blocks, unsigned nr,
+		   int32_t *nr_allocations)
+{
+	int r;
+	unsigned done;
+
+	*nr_allocations = 0;
+	qsort(blocks, nr, sizeof(*blocks), cmp_block);
+
+	while (nr) {
+		r = sm_ll_inc_bitmap(ll, blocks, nr, &done, nr_allocations);
+		if (r < 0)
+			return r;
+
+		blocks += done;
+		nr -= done;
+	}
+
+	return 0;
+}
+
 static int dec_ref_count(void *context, uint32_t old, uint32_t *new)
 {
 	if (!old) {
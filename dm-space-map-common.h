@@ -112,6 +112,19 @@ int sm_ll_find_free_block(struct ll_disk *ll, dm_block_t begin,
 int sm_ll_insert(struct ll_disk *ll, dm_block_t b, uint32_t ref_count, enum allocation_event *ev);
 int sm_ll_inc(struct ll_disk *ll, dm_block_t b, enum allocation_event *ev);
 int sm_ll_dec(struct ll_disk *ll, dm_block_t b, enum allocation_event *ev);
+
+/*
+ * Increments every block in @blocks, which is sorted so that all the
+ * changes to each bitmap are made together.  @nr_allocations is set to
+ * how many of the blocks were free.
+ *
+ * If it fails, the blocks sorted before the one that failed have been
+ * incremented, and @nr_allocations counts those.  The failed block's
+ * count may be left half updated, so the space map shouldn't be
+ * committed.
+ */
+int sm_ll_inc_many(struct ll_disk *ll, dm_block_t *blocks, unsigned nr,
+		   int32_t *nr_allocations);
 int sm_ll_commit(struct ll_disk *ll);
 
 int sm_ll_new_metadata(struct ll_disk *ll, struct dm_transaction_manager *tm);
@@ -43,20 +43,23 @@ static int extend_(struct dm_space_map *sm, dm_block_t extra_blocks)
 static int get_nr_blocks_(struct dm_space_map *sm, dm_block_t *count)
 {
 	struct sm_core *smc = to_smc(sm);
-	return smc->nr_blocks;
+	*count = smc->nr_blocks;
+	return 0;
 }
 
 static int get_nr_free_(struct dm_space_map *sm, dm_block_t *count)
 {
 	struct sm_core *smc = to_smc(sm);
-	return smc->nr_free;
+	*count = smc->nr_free;
+	return 0;
 }
 
 static int get_count_(struct dm_space_map *sm, dm_block_t b, uint32_t *result)
 {
 	struct sm_core *smc = to_smc(sm);
 	check_index_(smc, b);
-	return smc->ref_counts[b];
+	*result = smc->ref_counts[b];
+	return 0;
 }
 
 static int count_is_more_than_one_(struct dm_space_map *sm, dm_block_t b,
@@ -64,7 +67,8 @@ static int count_is_more_than_one_(struct dm_space_map *sm, dm_block_t b,
 {
 	struct sm_core *smc = to_smc(sm);
 	check_index_(smc, b);
-	return smc->ref_counts[b] > 1;
+	*result = smc->ref_counts[b] > 1;
+	return 0;
 }
 
 static int set_count_(struct dm_space_map *sm, dm_block_t b, uint32_t count)
@@ -167,6 +171,7 @@ struct dm_space_map *dm_sm_core_create(dm_block_t nr_blocks)
 	smc->sm.set_count = set_count_;
 	smc->sm.commit = commit_;
 	smc->sm.inc_block = inc_block_;
+	smc->sm.inc_blocks = NULL;
 	smc->sm.dec_block = dec_block_;
 	smc->sm.new_block = new_block_;
 	smc->sm.root_size = root_size_;
@@ -142,6 +142,19 @@ static int sm_disk_inc_block(struct dm_space_map *sm, dm_block_t b)
 	return r;
 }
 
+static int sm_disk_inc_blocks(struct dm_space_map *sm, dm_block_t *blocks, unsigned nr)
+{
+	int r;
+	int32_t nr_allocations;
+	struct sm_disk *smd = container_of(sm, struct sm_disk, sm);
+
+	// Even on failure, some of the blocks may have been allocated.
+	r = sm_ll_inc_many(&smd->ll, blocks, nr, &nr_allocations);
+	smd->nr_allocated_this_transaction += nr_allocations;
+
+	return r;
+}
+
 static int sm_disk_dec_block(struct dm_space_map *sm, dm_block_t b)
 {
 	int r;
@@ -245,6 +258,7 @@ static struct dm_space_map ops = {
 	.count_is_more_than_one = sm_disk_count_is_more_than_one,
 	.set_count = sm_disk_set_count,
 	.inc_block = sm_disk_inc_block,
+	.inc_blocks = sm_disk_inc_blocks,
 	.dec_block = sm_disk_dec_block,
 	.new_block = sm_disk_new_block,
 	.commit = sm_disk_commit,
@@ -426,6 +426,26 @@ static int sm_metadata_inc_block(struct dm_space_map *sm, dm_block_t b)
 	return combine_errors(r, r2);
 }
 
+static int sm_metadata_inc_blocks(struct dm_space_map *sm, dm_block_t *blocks,
+				  unsigned nr)
+{
+	int r = 0, r2 = 0;
+	unsigned i;
+	int32_t nr_allocations;
+	struct sm_metadata *smm = container_of(sm, struct sm_metadata, sm);
+
+	if (recursing(smm)) {
+		for (i = 0; i < nr && !r; i++)
+			r = add_bop(smm, BOP_INC, blocks[i]);
+	} else {
+		in(smm);
+		r = sm_ll_inc_many(&smm->ll, blocks, nr, &nr_allocations);
+		r2 = out(smm);
+	}
+
+	return combine_errors(r, r2);
+}
+
 static int sm_metadata_dec_block(struct dm_space_map *sm, dm_block_t b)
 {
 	int r, r2 = 0;
@@ -555,6 +575,7 @@ static const struct dm_space_map ops = {
 	.count_is_more_than_one = sm_metadata_count_is_more_than_one,
 	.set_count = sm_metadata_set_count,
 	.inc_block = sm_metadata_inc_block,
+	.inc_blocks = sm_metadata_inc_blocks,
 	.dec_block = sm_metadata_dec_block,
 	.new_block = sm_metadata_new_block,
 	.commit = sm_metadata_commit,
@@ -51,6 +51,12 @@ struct dm_space_map {
 	int (*inc_block)(struct dm_space_map *sm, dm_block_t b);
 	int (*dec_block)(struct dm_space_map *sm, dm_block_t b);
 
+	/*
+	 * Optional.  Increments all of @blocks, in whatever order is
+	 * cheapest; @blocks may be reordered.
+	 */
+	int (*inc_blocks)(struct dm_space_map *sm, dm_block_t *blocks, unsigned nr);
+
 	/*
 	 * new_block will increment the returned block.
 	 */
@@ -124,6 +130,24 @@ static inline int dm_sm_inc_block(struct dm_space_map *sm, dm_block_t b)
 	return sm->inc_block(sm, b);
 }
 
+static inline int dm_sm_inc_blocks(struct dm_space_map *sm, dm_block_t *blocks,
+				   unsigned nr)
+{
+	int r;
+	unsigned i;
+
+	if (sm->inc_blocks)
+		return sm->inc_blocks(sm, blocks, nr);
+
+	for (i = 0; i < nr; i++) {
+		r = sm->inc_block(sm, blocks[i]);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
 static inline int dm_sm_dec_block(struct dm_space_map *sm, dm_block_t b)
 {
 	return sm->dec_block(sm, b);
@@ -78,16 +78,181 @@ static void prefetch_issue(struct prefetch_set *p, struct dm_block_manager *bm)
 
 /*----------------------------------------------------------------*/
 
-struct shadow_info {
-	struct hlist_node hlist;
-	dm_block_t where;
+/*
+ * The blocks shadowed, or allocated, in this transaction.  Open
+ * addressing with linear probing.  The table is kept at most half full
+ * and doubles when it gets fuller than that, so it scales with the size
+ * of the transaction.
+ *
+ * A slot is only in use if it's tagged with the current epoch.  Commit
+ * just moves to the next epoch, so the storage is reused from one
+ * transaction to the next and clearing it is O(1).
+ */
+#define SHADOW_MIN_BITS 8
+
+struct shadow_slot {
+	dm_block_t b;
+	uint32_t epoch;
+};
+
+struct shadow_set {
+	unsigned bits;
+	unsigned nr_entries;
+	uint32_t epoch;
+	struct shadow_slot *slots;
 };
 
+static bool shadow_set_init(struct shadow_set *s)
+{
+	s->bits = SHADOW_MIN_BITS;
+	s->nr_entries = 0;
+	s->epoch = 1;
+	s->slots = zalloc(sizeof(*s->slots) << s->bits);
+
+	return s->slots;
+}
+
+static void shadow_set_exit(struct shadow_set *s)
+{
+	kfree(s->slots);
+}
+
+static struct shadow_slot *shadow_find_slot(struct shadow_set *s, dm_block_t b)
+{
+	unsigned mask = (1u << s->bits) - 1;
+	unsigned i = hash_64(b, s->bits);
+
+	while (s->slots[i].epoch == s->epoch && s->slots[i].b != b)
+		i = (i + 1) & mask;
+
+	return s->slots + i;
+}
+
+static bool shadow_set_contains(struct shadow_set *s, dm_block_t b)
+{
+	struct shadow_slot *slot = shadow_find_slot(s, b);
+	return slot->epoch == s->epoch;
+}
+
+static bool shadow_set_grow(struct shadow_set *s)
+{
+	unsigned i, old_nr = 1u << s->bits;
+	struct shadow_slot *old = s->slots;
+	struct shadow_slot *slots = zalloc(sizeof(*slots) << (s->bits + 1));
+
+	if (!slots)
+		return false;
+
+	s->slots = slots;
+	s->bits++;
+	for (i = 0; i < old_nr; i++)
+		if (old[i].epoch == s->epoch)
+			*shadow_find_slot(s, old[i].b) = old[i];
+
+	kfree(old);
+	return true;
+}
+
+static void shadow_set_insert(struct shadow_set *s, dm_block_t b)
+{
+	struct shadow_slot *slot;
+
+	if (2 * (s->nr_entries + 1) > (1u << s->bits) && !shadow_set_grow(s))
+		return;
+
+	slot = shadow_find_slot(s, b);
+	if (slot->epoch != s->epoch) {
+		slot->b = b;
+		slot->epoch = s->epoch;
+		s->nr_entries++;
+	}
+}
+
+static void shadow_set_clear(struct shadow_set *s)
+{
+	s->nr_entries = 0;
+	s->epoch++;
+
+	// Slots from 2^32 transactions ago would look live again.
+	if (!s->epoch) {
+		memset(s->slots, 0, sizeof(*s->slots) << s->bits);
+		s->epoch = 1;
+	}
+}
+
 /*
- * It would be nice if we scaled with the size of transaction.
+ * A list of blocks, each tagged with the transaction it was freed in.
+ * The storage is kept when the list is emptied.
  */
-#define DM_HASH_SIZE 256
-#define DM_HASH_MASK (DM_HASH_SIZE - 1)
+struct freed_block {
+	dm_block_t b;
+	unsigned gen;
+
+	// The space map has handed it out again, and we kept it.
+	bool parked;
+};
+
+struct freed_list {
+	unsigned nr;
+	unsigned size;
+	struct freed_block *entries;
+};
+
+static void freed_list_init(struct freed_list *l)
+{
+	l->nr = 0;
+	l->size = 0;
+	l->entries = NULL;
+}
+
+static void freed_list_exit(struct freed_list *l)
+{
+	kfree(l->entries);
+}
+
+static int freed_list_push(struct freed_list *l, dm_block_t b, unsigned gen)
+{
+	unsigned size;
+	struct freed_block *entries;
+
+	if (l->nr == l->size) {
+		size = l->size ? 2 * l->size : 64;
+		entries = kmalloc(sizeof(*entries) * size, GFP_NOIO);
+		if (!entries)
+			return -ENOMEM;
+
+		if (l->nr)
+			memcpy(entries, l->entries, sizeof(*entries) * l->nr);
+		kfree(l->entries);
+		l->entries = entries;
+		l->size = size;
+	}
+
+	l->entries[l->nr].b = b;
+	l->entries[l->nr].gen = gen;
+	l->entries[l->nr].parked = false;
+	l->nr++;
+
+	return 0;
+}
+
+static int cmp_freed(const void *lhs, const void *rhs)
+{
+	dm_block_t l = ((struct freed_block *) lhs)->b;
+	dm_block_t r = ((struct freed_block *) rhs)->b;
+
+	return l < r ? -1 : l > r;
+}
+
+// The list must be sorted.
+static struct freed_block *freed_list_find(struct freed_list *l, dm_block_t b)
+{
+	struct freed_block key = {.b = b};
+
+	return bsearch(&key, l->entries, l->nr, sizeof(key), cmp_freed);
+}
+
+/*----------------------------------------------------------------*/
 
 struct dm_transaction_manager {
 	int is_clone;
@@ -97,25 +262,41 @@ struct dm_transaction_manager {
 	struct dm_space_map *sm;
 
 	spinlock_t lock;
-	struct hlist_head buckets[DM_HASH_SIZE];
+	struct shadow_set shadows;
 
 	struct prefetch_set prefetches;
+
+	/*
+	 * Views.  gen counts the commits.  The real tm keeps its open
+	 * views on a list, oldest first; each view remembers the gen it
+	 * was opened in.
+	 */
+	int is_view;
+	unsigned gen;
+	struct list_head views;
+
+	/*
+	 * Blocks whose count may have dropped to zero this transaction,
+	 * and blocks freed in earlier ones that the views still need.
+	 */
+	struct freed_list freed;
+	struct freed_list quarantine;
+
+	/*
+	 * Set if a freed block couldn't be recorded.  A view might then
+	 * see it reused, so the transaction can't be committed.
+	 */
+	int freed_error;
 };
 
 /*----------------------------------------------------------------*/
 
 static int is_shadow(struct dm_transaction_manager *tm, dm_block_t b)
 {
-	int r = 0;
-	unsigned bucket = dm_hash_block(b, DM_HASH_MASK);
-	struct shadow_info *si;
+	int r;
 
 	spin_lock(&tm->lock);
-	hlist_for_each_entry(si, tm->buckets + bucket, hlist)
-		if (si->where == b) {
-			r = 1;
-			break;
-		}
+	r = shadow_set_contains(&tm->shadows, b);
 	spin_unlock(&tm->lock);
 
 	return r;
@@ -127,35 +308,15 @@ static int is_shadow(struct dm_transaction_manager *tm, dm_block_t b)
  */
 static void insert_shadow(struct dm_transaction_manager *tm, dm_block_t b)
 {
-	unsigned bucket;
-	struct shadow_info *si;
-
-	si = kmalloc(sizeof(*si), GFP_NOIO);
-	if (si) {
-		si->where = b;
-		bucket = dm_hash_block(b, DM_HASH_MASK);
-		spin_lock(&tm->lock);
-		hlist_add_head(&si->hlist, tm->buckets + bucket);
-		spin_unlock(&tm->lock);
-	}
+	spin_lock(&tm->lock);
+	shadow_set_insert(&tm->shadows, b);
+	spin_unlock(&tm->lock);
 }
 
 static void wipe_shadow_table(struct dm_transaction_manager *tm)
 {
-	struct shadow_info *si;
-	struct hlist_node *tmp;
-	struct hlist_head *bucket;
-	int i;
-
 	spin_lock(&tm->lock);
-	for (i = 0; i < DM_HASH_SIZE; i++) {
-		bucket = tm->buckets + i;
-		hlist_for_each_entry_safe(si, tmp, bucket, hlist)
-			kfree(si);
-
-		INIT_HLIST_HEAD(bucket);
-	}
-
+	shadow_set_clear(&tm->shadows);
 	spin_unlock(&tm->lock);
 }
 
@@ -164,24 +325,33 @@ static void wipe_shadow_table(struct dm_transaction_manager *tm)
 struct dm_transaction_manager *dm_tm_create(struct dm_block_manager *bm,
 					    struct dm_space_map *sm)
 {
-	int i;
 	struct dm_transaction_manager *tm;
 
 	tm = kmalloc(sizeof(*tm), GFP_KERNEL);
 	if (!tm)
 		return ERR_PTR(-ENOMEM);
 
+	if (!shadow_set_init(&tm->shadows)) {
+		kfree(tm);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	tm->is_clone = 0;
 	tm->real = NULL;
 	tm->bm = bm;
 	tm->sm = sm;
 
 	spin_lock_init(&tm->lock);
-	for (i = 0; i < DM_HASH_SIZE; i++)
-		INIT_HLIST_HEAD(tm->buckets + i);
 
 	prefetch_init(&tm->prefetches);
 
+	tm->is_view = 0;
+	tm->gen = 0;
+	INIT_LIST_HEAD(&tm->views);
+	freed_list_init(&tm->freed);
+	freed_list_init(&tm->quarantine);
+	tm->freed_error = 0;
+
 	return tm;
 }
 
@@ -193,15 +363,47 @@ struct dm_transaction_manager *dm_tm_create_non_blocking_clone(struct dm_transac
 	if (tm) {
 		tm->is_clone = 1;
 		tm->real = real;
+		tm->is_view = 0;
 	}
 
 	return tm;
 }
 
+struct dm_transaction_manager *dm_tm_open_view(struct dm_transaction_manager *real)
+{
+	struct dm_transaction_manager *tm;
+
+	// Only the fields below are used, but zeroing the rest means a
+	// stray access fails cleanly rather than reading garbage.
+	tm = kzalloc(sizeof(*tm), GFP_KERNEL);
+	if (!tm)
+		return ERR_PTR(-ENOMEM);
+
+	tm->is_clone = 1;
+	tm->real = real;
+	tm->bm = real->bm;
+	tm->is_view = 1;
+
+	spin_lock(&real->lock);
+	tm->gen = real->gen;
+	list_add_tail(&tm->views, &real->views);
+	spin_unlock(&real->lock);
+
+	return tm;
+}
+
 void dm_tm_destroy(struct dm_transaction_manager *tm)
 {
-	if (!tm->is_clone)
-		wipe_shadow_table(tm);
+	if (tm->is_view) {
+		spin_lock(&tm->real->lock);
+		list_del(&tm->views);
+		spin_unlock(&tm->real->lock);
+
+	} else if (!tm->is_clone) {
+		shadow_set_exit(&tm->shadows);
+		freed_list_exit(&tm->freed);
+		freed_list_exit(&tm->quarantine);
+	}
 
 	kfree(tm);
 }
@@ -213,6 +415,9 @@ int dm_tm_pre_commit(struct dm_transaction_manager *tm)
 	if (tm->is_clone)
 		return -EWOULDBLOCK;
 
+	if (tm->freed_error)
+		return tm->freed_error;
+
 	r = dm_sm_commit(tm->sm);
 	if (r < 0)
 		return r;
@@ -220,15 +425,141 @@ int dm_tm_pre_commit(struct dm_transaction_manager *tm)
 	return dm_bm_flush(tm->bm);
 }
 
+/*
+ * Called once a commit is durable.  The blocks freed in the transaction
+ * just committed can be reused from now on, so any that a view might be
+ * reading are quarantined.  They're released at the first commit after
+ * every view that could need them has been destroyed.
+ *
+ * Rather than take a reference on every quarantined block, which the
+ * space maps wouldn't honour until the next commit, we check each block
+ * the space map allocates.  See tm_new_block().
+ */
+static int update_quarantine(struct dm_transaction_manager *tm)
+{
+	int r = 0;
+	unsigned i, nr, gen, oldest;
+	bool have_views;
+	uint32_t count;
+	struct freed_block *fb;
+	struct freed_list *q = &tm->quarantine, release;
+
+	spin_lock(&tm->lock);
+	have_views = !list_empty(&tm->views);
+	oldest = have_views ?
+		list_first_entry(&tm->views, struct dm_transaction_manager, views)->gen :
+		tm->gen + 1;
+	gen = tm->gen++;
+	spin_unlock(&tm->lock);
+
+	// Releasing a parked block can shadow space map blocks, which adds
+	// to tm->freed, so the freed blocks are dealt with first.
+	for (i = 0; have_views && i < tm->freed.nr; i++) {
+		fb = tm->freed.entries + i;
+
+		// Counts are checked here, rather than as blocks are
+		// decremented, since most of them are never needed.
+		r = dm_sm_get_count(tm->sm, fb->b, &count);
+		if (r)
+			return r;
+
+		if (!count) {
+			r = freed_list_push(q, fb->b, gen);
+			if (r)
+				return r;
+		}
+	}
+	tm->freed.nr = 0;
+
+	// Releasing a parked block can allocate space map blocks, which
+	// looks in the quarantine, so it's sorted before any are released.
+	freed_list_init(&release);
+	for (i = 0, nr = 0; i < q->nr; i++) {
+		fb = q->entries + i;
+		if (fb->gen >= oldest)
+			q->entries[nr++] = *fb;
+
+		else if (fb->parked) {
+			r = freed_list_push(&release, fb->b, fb->gen);
+			if (r)
+				goto out;
+		}
+	}
+	q->nr = nr;
+
+	// A block may have been decremented more than once before it was
+	// freed.
+	if (q->nr)
+		qsort(q->entries, q->nr, sizeof(*q->entries), cmp_freed);
+	for (i = 1, nr = q->nr ? 1 : 0; i < q->nr; i++)
+		if (q->entries[i].b != q->entries[nr - 1].b)
+			q->entries[nr++] = q->entries[i];
+	q->nr = nr;
+
+	for (i = 0; i < release.nr; i++) {
+		r = dm_sm_dec_block(tm->sm, release.entries[i].b);
+		if (r)
+			break;
+	}
+
+out:
+	freed_list_exit(&release);
+	return r;
+}
+
+/*
+ * Views may be opened at any point in a transaction, so every freed
+ * block is recorded, whether there are views yet or not.  Failures are
+ * sticky, and stop the transaction being committed.
+ */
+static int record_free(struct dm_transaction_manager *tm, dm_block_t b)
+{
+	int r = freed_list_push(&tm->freed, b, tm->gen);
+
+	if (r && !tm->freed_error)
+		tm->freed_error = r;
+
+	return r;
+}
+
+/*
+ * Allocates a block, skipping any in quarantine.  Those are left
+ * allocated, so the space map won't offer them again, until they're
+ * released.
+ */
+static int tm_new_block(struct dm_transaction_manager *tm, dm_block_t *result)
+{
+	int r;
+	struct freed_block *fb;
+
+	for (;;) {
+		r = dm_sm_new_block(tm->sm, result);
+		if (r < 0 || !tm->quarantine.nr)
+			return r;
+
+		fb = freed_list_find(&tm->quarantine, *result);
+		if (!fb)
+			return 0;
+
+		fb->parked = true;
+	}
+}
+
 int dm_tm_commit(struct dm_transaction_manager *tm, struct dm_block *root)
 {
+	int r;
+
 	if (tm->is_clone)
 		return -EWOULDBLOCK;
 
 	wipe_shadow_table(tm);
 	dm_bm_unlock(root);
 
-	return dm_bm_flush(tm->bm);
+	r = dm_bm_flush(tm->bm);
+	if (r)
+		return r;
+
+	return update_quarantine(tm);
 }
 
 int dm_tm_new_block(struct dm_transaction_manager *tm,
@@ -241,7 +572,7 @@ int dm_tm_new_block(struct dm_transaction_manager *tm,
 	if (tm->is_clone)
 		return -EWOULDBLOCK;
 
-	r = dm_sm_new_block(tm->sm, &new_block);
+	r = tm_new_block(tm, &new_block);
 	if (r < 0)
 		return r;
 
@@ -260,15 +591,30 @@ int dm_tm_new_block(struct dm_transaction_manager *tm,
 	return 0;
 }
 
+/*
+ * If nothing else refers to @orig its cached buffer is handed over to
+ * the new block, rather than copied.  That drops @orig from the cache,
+ * so code that still reads the old copy this transaction, such as the
+ * space maps, will reread it from disk.  Shadowing is far more common,
+ * so it's the one that's made cheap.  If the bm can't move the buffer
+ * we fall back to copying.
+ */
 static int __shadow_block(struct dm_transaction_manager *tm, dm_block_t orig,
 			  struct dm_block_validator *v,
-			  struct dm_block **result)
+			  struct dm_block **result, int exclusive)
 {
 	int r;
 	dm_block_t new;
 	struct dm_block *orig_block;
 
-	r = dm_sm_new_block(tm->sm, &new);
+	r = tm_new_block(tm, &new);
+	if (r < 0)
+		return r;
+
+	// Even a shared block may be freed by this; the count is checked
+	// at commit.  Recording it first means a failure to record leaves
+	// the count alone.
+	r = record_free(tm, orig);
 	if (r < 0)
 		return r;
 
@@ -276,17 +622,16 @@ static int __shadow_block(struct dm_transaction_manager *tm, dm_block_t orig,
 	if (r < 0)
 		return r;
 
+	if (exclusive) {
+		r = dm_bm_write_lock_move(tm->bm, orig, new, v, result);
+		if (r != -ENODATA)
+			return r;
+	}
+
 	r = dm_bm_read_lock(tm->bm, orig, v, &orig_block);
 	if (r < 0)
 		return r;
 
-	/*
-	 * It would be tempting to use dm_bm_unlock_move here, but some
-	 * code, such as the space maps, keeps using the old data structures
-	 * secure in the knowledge they won't be changed until the next
-	 * transaction.  Using unlock_move would force a synchronous read
-	 * since the old block would no longer be in the cache.
-	 */
 	r = dm_bm_write_lock_zero(tm->bm, new, v, result);
 	if (r) {
 		dm_bm_unlock(orig_block);
@@ -316,7 +661,7 @@ int dm_tm_shadow_block(struct dm_transaction_manager *tm, dm_block_t orig,
 	if (is_shadow(tm, orig) && !*inc_children)
 		return dm_bm_write_lock(tm->bm, orig, v, result);
 
-	r = __shadow_block(tm, orig, v, result);
+	r = __shadow_block(tm, orig, v, result, !*inc_children);
 	if (r < 0)
 		return r;
 	insert_shadow(tm, dm_block_location(*result));
@@ -328,7 +673,7 @@ int dm_tm_read_lock(struct dm_transaction_manager *tm, dm_block_t b,
 		    struct dm_block_validator *v,
 		    struct dm_block **blk)
 {
-	if (tm->is_clone) {
+	if (tm->is_clone && !tm->is_view) {
 		int r = dm_bm_read_try_lock(tm->real->bm, b, v, blk);
 
 		if (r == -EWOULDBLOCK)
@@ -355,6 +700,17 @@ void dm_tm_inc(struct dm_transaction_manager *tm, dm_block_t b)
 	dm_sm_inc_block(tm->sm, b);
 }
 
+int dm_tm_inc_many(struct dm_transaction_manager *tm, dm_block_t *blocks,
+		   unsigned nr)
+{
+	/*
+	 * The non-blocking clone doesn't support this.
+	 */
+	assert(!tm->is_clone);
+
+	return dm_sm_inc_blocks(tm->sm, blocks, nr);
+}
+
 void dm_tm_dec(struct dm_transaction_manager *tm, dm_block_t b)
 {
 	/*
@@ -363,11 +719,16 @@ void dm_tm_dec(struct dm_transaction_manager *tm, dm_block_t b)
 	assert(!tm->is_clone);
 
 	dm_sm_dec_block(tm->sm, b);
+	record_free(tm, b);
 }
 
 int dm_tm_ref(struct dm_transaction_manager *tm, dm_block_t b,
 	      uint32_t *result)
 {
+	// The space map belongs to the writer.
+	if (tm->is_view)
+		return -EINVAL;
+
 	if (tm->is_clone)
 		return -EWOULDBLOCK;
 
@@ -381,6 +742,10 @@ struct dm_block_manager *dm_tm_get_bm(struct dm_transaction_manager *tm)
 
 void dm_tm_issue_prefetches(struct dm_transaction_manager *tm)
 {
+	// Clones have no prefetch set of their own.
+	if (tm->is_clone)
+		tm = tm->real;
+
 	prefetch_issue(&tm->prefetches, tm->bm);
 }
 
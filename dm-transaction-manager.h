@@ -35,14 +35,50 @@ void dm_tm_destroy(struct dm_transaction_manager *tm);
  */
 struct dm_transaction_manager *dm_tm_create_non_blocking_clone(struct dm_transaction_manager *real);
 
+/*
+ * A view is a read only tm for looking at the metadata as it was at the
+ * last commit, from another thread, while the real tm carries on with
+ * the next transaction.  Since committed blocks are never changed in
+ * place, all a view needs is for the blocks it can see not to be reused
+ * while it's open.  So blocks freed while any view is open are held
+ * back until the views that might read them have been destroyed.
+ *
+ * Open the view first, then read the root from the superblock through
+ * it.  Locks on a view block, like those on the real tm, but it can't
+ * change anything.  Call dm_tm_destroy() to close it.
+ *
+ * Only dm_tm_read_lock(), dm_tm_unlock(), dm_tm_get_bm() and
+ * dm_tm_issue_prefetches(), which goes to the real tm, may be used on a
+ * view.  The calls that change things fail with -EWOULDBLOCK, as they do
+ * for a non-blocking clone; dm_tm_ref() fails with -EINVAL, since the
+ * space map belongs to the writer; dm_tm_inc() and dm_tm_dec() mustn't
+ * be called.
+ *
+ * Held back blocks stay free in the space map, the tm just won't use
+ * them.  Any the space map offers are kept allocated until the first
+ * commit after they're no longer needed, so a crash before then leaks
+ * those, and the real tm should commit once the views are gone.
+ *
+ * The space map must not reuse blocks freed in the current transaction,
+ * which the disk and metadata space maps never do.
+ *
+ * Freed blocks are recorded whether or not any views are open, since
+ * one may be opened later in the transaction.  If one can't be recorded
+ * for lack of memory, dm_tm_pre_commit() fails with -ENOMEM.
+ */
+struct dm_transaction_manager *dm_tm_open_view(struct dm_transaction_manager *real);
+
 /*
  * We use a 2-phase commit here.
  *
  * i) Make all changes for the transaction *except* for the superblock.
- * Then call dm_tm_pre_commit() to flush them to disk.
+ * Then call dm_tm_pre_commit() to flush them to disk.  It returns once
+ * they're durable.
  *
  * ii) Lock your superblock.  Update.  Then call dm_tm_commit() which will
- * unlock the superblock and flush it.  No other blocks should be updated
+ * unlock the superblock and flush it, again returning once it's durable.
+ * So the superblock can never reach the disk before the blocks it refers
+ * to.  No other blocks should be updated
  * during this period.  Care should be taken to never unlock a partially
  * updated superblock; perform any operations that could fail *before* you
  * take the superblock lock.
@@ -101,6 +137,16 @@ void dm_tm_unlock(struct dm_transaction_manager *tm, struct dm_block *b);
  */
 void dm_tm_inc(struct dm_transaction_manager *tm, dm_block_t b);
 
+/*
+ * Increments many blocks at once, which is much cheaper than calling
+ * dm_tm_inc() on each when they share bitmaps.  @blocks may be
+ * reordered.  Unlike dm_tm_inc() it reports errors, after which some of
+ * the blocks may have been incremented and the transaction should be
+ * abandoned.
+ */
+int dm_tm_inc_many(struct dm_transaction_manager *tm, dm_block_t *blocks,
+		   unsigned nr);
+
 void dm_tm_dec(struct dm_transaction_manager *tm, dm_block_t b);
 
 int dm_tm_ref(struct dm_transaction_manager *tm, dm_block_t b,
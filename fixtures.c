@@ -0,0 +1,62 @@
+#include "fixtures.h"
+#include "framework.h"
+
+#include "compat/memory.h"
+
+#include "dm-space-map-core.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------
+
+int create_block_file(unsigned block_size, dm_block_t nr_blocks)
+{
+	char path[] = "/tmp/unit-test-XXXXXX";
+	int fd = mkstemp(path);
+	T_ASSERT(fd >= 0);
+	unlink(path);
+
+	T_ASSERT(!ftruncate(fd, (off_t) block_size * nr_blocks));
+
+	return fd;
+}
+
+static void open_bm_(struct tm_fixture *tf, unsigned block_size, dm_block_t nr_blocks,
+		     unsigned max_held, unsigned cache_size)
+{
+	block_device_init_fd(&tf->bdev, create_block_file(block_size, nr_blocks));
+
+	tf->bm = dm_block_manager_create(&tf->bdev, block_size, max_held, cache_size);
+	T_ASSERT(tf->bm);
+}
+
+void tm_fixture_init(struct tm_fixture *tf, unsigned block_size, dm_block_t nr_blocks,
+		     unsigned max_held, unsigned cache_size)
+{
+	open_bm_(tf, block_size, nr_blocks, max_held, cache_size);
+
+	tf->sm = dm_sm_core_create(nr_blocks);
+	T_ASSERT(tf->sm);
+
+	tf->tm = dm_tm_create(tf->bm, tf->sm);
+	T_ASSERT(!IS_ERR(tf->tm));
+}
+
+void tm_fixture_init_metadata(struct tm_fixture *tf, unsigned block_size,
+			      dm_block_t nr_blocks, unsigned max_held,
+			      unsigned cache_size, dm_block_t superblock)
+{
+	open_bm_(tf, block_size, nr_blocks, max_held, cache_size);
+	T_ASSERT(!dm_tm_create_with_sm(tf->bm, superblock, &tf->tm, &tf->sm));
+}
+
+void tm_fixture_exit(struct tm_fixture *tf)
+{
+	dm_tm_destroy(tf->tm);
+	dm_sm_destroy(tf->sm);
+	dm_block_manager_destroy(tf->bm);
+	close(tf->bdev.fd);
+}
+
+//-----------------------------------------------------------------
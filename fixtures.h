@@ -0,0 +1,36 @@
+#ifndef TEST_UNIT_FIXTURES_H
+#define TEST_UNIT_FIXTURES_H
+
+#include "compat/dm-block-manager.h"
+
+#include "dm-space-map.h"
+#include "dm-transaction-manager.h"
+
+//-----------------------------------------------------------------
+
+// An unlinked temporary file of @nr_blocks blocks that read back as zeroes.
+int create_block_file(unsigned block_size, dm_block_t nr_blocks);
+
+/*
+ * A bm on a temporary file, and a tm on top of it.  tm_fixture_init()
+ * gives the tm a core space map.  tm_fixture_init_metadata() has the tm
+ * create a metadata space map, stored in the file with its superblock
+ * at @superblock.
+ */
+struct tm_fixture {
+	struct block_device bdev;
+	struct dm_block_manager *bm;
+	struct dm_space_map *sm;
+	struct dm_transaction_manager *tm;
+};
+
+void tm_fixture_init(struct tm_fixture *tf, unsigned block_size, dm_block_t nr_blocks,
+		     unsigned max_held, unsigned cache_size);
+void tm_fixture_init_metadata(struct tm_fixture *tf, unsigned block_size,
+			      dm_block_t nr_blocks, unsigned max_held,
+			      unsigned cache_size, dm_block_t superblock);
+void tm_fixture_exit(struct tm_fixture *tf);
+
+//-----------------------------------------------------------------
+
+#endif
@@ -218,6 +218,7 @@ static bool _run_tests(struct test_details **tests, unsigned nr)
 static void _usage(void)
 {
 	fprintf(stderr, "Usage: unit-test <list|run> [pattern]\n");
+	fprintf(stderr, "Set UNIT_TEST_BENCH to include the benchmarks.\n");
 }
 
 static int _cmp_paths(const void *lhs, const void *rhs)
@@ -0,0 +1,165 @@
+#include "fixtures.h"
+#include "framework.h"
+#include "units.h"
+
+#include "compat/memory.h"
+
+#include "dm-space-map-disk.h"
+#include "dm-transaction-manager.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//--------------------------------------------------------
+
+#define BLOCK_SIZE 4096
+#define CACHE_SIZE 256
+#define NR_METADATA_BLOCKS 4096
+
+// Enough for several bitmaps.
+#define NR_DATA_BLOCKS 100000
+
+//--------------------------------------------------------
+
+/*
+ * A disk space map, kept in metadata managed by a core space map.
+ */
+struct fixture {
+	struct tm_fixture tf;
+	struct dm_space_map *sm;
+};
+
+static void *create_sm_()
+{
+	struct fixture *fix = malloc(sizeof(*fix));
+	T_ASSERT(fix);
+
+	tm_fixture_init(&fix->tf, BLOCK_SIZE, NR_METADATA_BLOCKS, 16, CACHE_SIZE);
+
+	fix->sm = dm_sm_disk_create(fix->tf.tm, NR_DATA_BLOCKS);
+	T_ASSERT(!IS_ERR(fix->sm));
+
+	return fix;
+}
+
+static void destroy_sm_(void *context)
+{
+	struct fixture *fix = context;
+	dm_sm_destroy(fix->sm);
+	tm_fixture_exit(&fix->tf);
+	free(fix);
+}
+
+//--------------------------------------------------------
+
+#define NR_INCS 250
+
+// Mostly in one bitmap, like the children of a btree node, with some
+// repeats to push counts past what the bitmap can hold.
+static void random_blocks_(dm_block_t *blocks, unsigned nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		if (i && !(i % 10))
+			blocks[i] = blocks[i - 1];
+		else if (!(i % 7))
+			blocks[i] = rand() % NR_DATA_BLOCKS;
+		else
+			blocks[i] = 20000 + rand() % 5000;
+	}
+}
+
+// Each block should have been incremented @rounds times for every time
+// it appears in @blocks.
+static void check_counts_(struct dm_space_map *sm, dm_block_t *blocks, unsigned nr,
+			  uint32_t rounds)
+{
+	unsigned i, j;
+	uint32_t expected, count;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0, expected = 0; j < nr; j++)
+			if (blocks[j] == blocks[i])
+				expected += rounds;
+
+		T_ASSERT(!dm_sm_get_count(sm, blocks[i], &count));
+		T_ASSERT_EQUAL(count, expected);
+	}
+}
+
+static void test_inc_blocks(void *context)
+{
+	unsigned i;
+	struct fixture *fix = context;
+	dm_block_t blocks[NR_INCS], copy[NR_INCS];
+
+	random_blocks_(blocks, NR_INCS);
+
+	// The sm sorts the array it's given.
+	memcpy(copy, blocks, sizeof(blocks));
+	T_ASSERT(!dm_sm_inc_blocks(fix->sm, copy, NR_INCS));
+	check_counts_(fix->sm, blocks, NR_INCS, 1);
+
+	// Again, so that every count goes into the ref count tree.
+	memcpy(copy, blocks, sizeof(blocks));
+	T_ASSERT(!dm_sm_inc_blocks(fix->sm, copy, NR_INCS));
+	for (i = 0; i < NR_INCS; i++)
+		T_ASSERT(!dm_sm_inc_block(fix->sm, blocks[i]));
+	check_counts_(fix->sm, blocks, NR_INCS, 3);
+}
+
+static unsigned nr_locks_(struct dm_block_manager *bm)
+{
+	struct dm_bm_stats stats;
+
+	dm_bm_get_stats(bm, &stats);
+	return stats.read_locks + stats.write_locks + stats.zero_locks + stats.moves;
+}
+
+static void test_inc_blocks_is_batched(void *context)
+{
+	unsigned i, batched, single;
+	struct fixture *fix = context;
+	dm_block_t blocks[NR_INCS];
+
+	for (i = 0; i < NR_INCS; i++)
+		blocks[i] = 1000 + 2 * i;
+
+	dm_bm_reset_stats(fix->tf.bm);
+	T_ASSERT(!dm_sm_inc_blocks(fix->sm, blocks, NR_INCS));
+	batched = nr_locks_(fix->tf.bm);
+
+	dm_bm_reset_stats(fix->tf.bm);
+	for (i = 0; i < NR_INCS; i++)
+		T_ASSERT(!dm_sm_inc_block(fix->sm, blocks[i] + 1));
+	single = nr_locks_(fix->tf.bm);
+
+	// One bitmap, so a single shadow and index update.
+	T_ASSERT(batched * 20 < single);
+}
+
+//--------------------------------------------------------
+
+#define T(path, desc, fn) register_test(ts, "/space-map/" path, desc, fn)
+
+static struct test_suite *disk_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_sm_, destroy_sm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("disk/inc-blocks", "a batch of increments matches doing them singly", test_inc_blocks);
+	T("disk/inc-blocks-batched", "a batch updates each bitmap once", test_inc_blocks_is_batched);
+
+	return ts;
+}
+
+void space_map_tests(struct list_head *suites)
+{
+	list_add(&disk_tests()->list, suites);
+}
+
+//--------------------------------------------------------
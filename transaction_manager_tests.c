@@ -0,0 +1,450 @@
+#include "fixtures.h"
+#include "framework.h"
+#include "units.h"
+
+#include "compat/memory.h"
+
+#include "dm-btree.h"
+#include "dm-space-map.h"
+#include "dm-transaction-manager.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+//--------------------------------------------------------
+
+#define BLOCK_SIZE 4096
+#define CACHE_SIZE 256
+#define NR_BLOCKS 8192
+
+// Enough to make the shadow table grow several times.
+#define NR_SHADOWS 2000
+
+#define SUPERBLOCK 0
+
+//--------------------------------------------------------
+
+static void *create_tm_()
+{
+	struct tm_fixture *fix = malloc(sizeof(*fix));
+	T_ASSERT(fix);
+
+	tm_fixture_init(fix, BLOCK_SIZE, NR_BLOCKS, 10, CACHE_SIZE);
+	T_ASSERT(!dm_sm_inc_block(fix->sm, SUPERBLOCK));
+
+	return fix;
+}
+
+static void destroy_tm_(void *context)
+{
+	tm_fixture_exit(context);
+	free(context);
+}
+
+//--------------------------------------------------------
+
+static void commit_(struct tm_fixture *fix)
+{
+	struct dm_block *sblock;
+
+	T_ASSERT(!dm_tm_pre_commit(fix->tm));
+	T_ASSERT(!dm_bm_write_lock_zero(fix->bm, SUPERBLOCK, NULL, &sblock));
+	T_ASSERT(!dm_tm_commit(fix->tm, sblock));
+}
+
+static void new_blocks_(struct tm_fixture *fix, dm_block_t *blocks, unsigned nr)
+{
+	unsigned i;
+	struct dm_block *b;
+
+	for (i = 0; i < nr; i++) {
+		T_ASSERT(!dm_tm_new_block(fix->tm, NULL, &b));
+		memset(dm_block_data(b), i, BLOCK_SIZE);
+		blocks[i] = dm_block_location(b);
+		dm_tm_unlock(fix->tm, b);
+	}
+}
+
+static dm_block_t shadow_(struct tm_fixture *fix, dm_block_t orig, uint8_t expected)
+{
+	int inc;
+	dm_block_t where;
+	struct dm_block *b;
+
+	T_ASSERT(!dm_tm_shadow_block(fix->tm, orig, NULL, &b, &inc));
+	T_ASSERT(!inc);
+	T_ASSERT_EQUAL(((uint8_t *) dm_block_data(b))[BLOCK_SIZE - 1], expected);
+	where = dm_block_location(b);
+	dm_tm_unlock(fix->tm, b);
+
+	return where;
+}
+
+//--------------------------------------------------------
+
+static void test_new_blocks_are_shadows(void *context)
+{
+	unsigned i;
+	struct tm_fixture *fix = context;
+	dm_block_t blocks[NR_SHADOWS];
+
+	new_blocks_(fix, blocks, NR_SHADOWS);
+
+	for (i = 0; i < NR_SHADOWS; i++)
+		T_ASSERT_EQUAL(shadow_(fix, blocks[i], i), blocks[i]);
+}
+
+static void test_shadow_of_shadow(void *context)
+{
+	unsigned i;
+	struct tm_fixture *fix = context;
+	dm_block_t blocks[NR_SHADOWS], shadows[NR_SHADOWS];
+
+	new_blocks_(fix, blocks, NR_SHADOWS);
+	commit_(fix);
+
+	for (i = 0; i < NR_SHADOWS; i++) {
+		shadows[i] = shadow_(fix, blocks[i], i);
+		T_ASSERT_NOT_EQUAL(shadows[i], blocks[i]);
+	}
+
+	for (i = 0; i < NR_SHADOWS; i++)
+		T_ASSERT_EQUAL(shadow_(fix, shadows[i], i), shadows[i]);
+}
+
+static void test_commit_forgets_shadows(void *context)
+{
+	unsigned i, round;
+	struct tm_fixture *fix = context;
+	dm_block_t blocks[NR_SHADOWS], shadow;
+
+	new_blocks_(fix, blocks, NR_SHADOWS);
+
+	for (round = 0; round < 3; round++) {
+		commit_(fix);
+
+		for (i = 0; i < NR_SHADOWS; i++) {
+			shadow = shadow_(fix, blocks[i], i);
+			T_ASSERT_NOT_EQUAL(shadow, blocks[i]);
+			blocks[i] = shadow;
+		}
+	}
+}
+
+#define NR_MOVES 16
+
+static void test_shadow_moves_buffer(void *context)
+{
+	unsigned i;
+	struct tm_fixture *fix = context;
+	struct dm_bm_stats stats;
+	dm_block_t blocks[NR_MOVES];
+
+	new_blocks_(fix, blocks, NR_MOVES);
+	commit_(fix);
+	dm_bm_reset_stats(fix->bm);
+
+	for (i = 0; i < NR_MOVES; i++)
+		T_ASSERT_NOT_EQUAL(shadow_(fix, blocks[i], i), blocks[i]);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.moves, NR_MOVES);
+	T_ASSERT_EQUAL(stats.bytes_read, 0);
+}
+
+static void test_shared_block_is_copied(void *context)
+{
+	int inc;
+	struct tm_fixture *fix = context;
+	struct dm_bm_stats stats;
+	struct dm_block *b;
+	dm_block_t orig;
+
+	new_blocks_(fix, &orig, 1);
+	T_ASSERT(!dm_sm_inc_block(fix->sm, orig));
+	commit_(fix);
+	dm_bm_reset_stats(fix->bm);
+
+	T_ASSERT(!dm_tm_shadow_block(fix->tm, orig, NULL, &b, &inc));
+	T_ASSERT(inc);
+	T_ASSERT_NOT_EQUAL(dm_block_location(b), orig);
+	dm_tm_unlock(fix->tm, b);
+
+	// The other owner still sees the original, without a read.
+	T_ASSERT(!dm_tm_read_lock(fix->tm, orig, NULL, &b));
+	dm_tm_unlock(fix->tm, b);
+
+	dm_bm_get_stats(fix->bm, &stats);
+	T_ASSERT_EQUAL(stats.moves, 0);
+	T_ASSERT_EQUAL(stats.bytes_read, 0);
+}
+
+//--------------------------------------------------------
+
+/*
+ * Views need a space map that doesn't reuse blocks within a transaction,
+ * so these use the metadata space map rather than the core one.
+ */
+#define NR_KEYS 10000
+#define NR_ROUNDS 8
+
+struct view_fixture {
+	struct tm_fixture tf;
+	struct dm_btree_info info;
+	dm_block_t root;
+};
+
+static void view_commit_(struct view_fixture *fix)
+{
+	struct dm_block *sblock;
+
+	T_ASSERT(!dm_tm_pre_commit(fix->tf.tm));
+	T_ASSERT(!dm_bm_write_lock_zero(fix->tf.bm, SUPERBLOCK, NULL, &sblock));
+	*((dm_block_t *) dm_block_data(sblock)) = fix->root;
+	T_ASSERT(!dm_tm_commit(fix->tf.tm, sblock));
+}
+
+static void insert_all_(struct view_fixture *fix, uint64_t offset)
+{
+	uint64_t k, v;
+
+	for (k = 0; k < NR_KEYS; k++) {
+		v = k + offset;
+		T_ASSERT(!dm_btree_insert(&fix->info, fix->root, &k, &v, &fix->root));
+	}
+}
+
+static void *create_view_tm_()
+{
+	struct view_fixture *fix = malloc(sizeof(*fix));
+	T_ASSERT(fix);
+
+	tm_fixture_init_metadata(&fix->tf, BLOCK_SIZE, NR_BLOCKS, 16, CACHE_SIZE, SUPERBLOCK);
+
+	fix->info.tm = fix->tf.tm;
+	fix->info.levels = 1;
+	fix->info.value_type.context = NULL;
+	fix->info.value_type.size = sizeof(uint64_t);
+	fix->info.value_type.inc = NULL;
+	fix->info.value_type.dec = NULL;
+	fix->info.value_type.equal = NULL;
+
+	T_ASSERT(!dm_btree_empty(&fix->info, &fix->root));
+	insert_all_(fix, 0);
+	view_commit_(fix);
+
+	return fix;
+}
+
+static void destroy_view_tm_(void *context)
+{
+	struct view_fixture *fix = context;
+	tm_fixture_exit(&fix->tf);
+	free(fix);
+}
+
+static dm_block_t view_root_(struct dm_transaction_manager *view)
+{
+	dm_block_t root;
+	struct dm_block *sblock;
+
+	T_ASSERT(!dm_tm_read_lock(view, SUPERBLOCK, NULL, &sblock));
+	root = *((dm_block_t *) dm_block_data(sblock));
+	dm_tm_unlock(view, sblock);
+
+	return root;
+}
+
+static void check_all_(struct dm_transaction_manager *view, dm_block_t root,
+		       struct dm_btree_info *info, uint64_t offset)
+{
+	uint64_t k, v;
+	struct dm_btree_info view_info = *info;
+
+	view_info.tm = view;
+	for (k = 0; k < NR_KEYS; k++) {
+		T_ASSERT(!dm_btree_lookup(&view_info, root, &k, &v));
+		T_ASSERT_EQUAL(v, k + offset);
+	}
+}
+
+static void test_view_is_stable(void *context)
+{
+	unsigned round;
+	struct view_fixture *fix = context;
+	struct dm_transaction_manager *view = dm_tm_open_view(fix->tf.tm);
+	dm_block_t root;
+
+	// The superblock changes at the next commit, so the root is read
+	// straight away.
+	T_ASSERT(!IS_ERR(view));
+	root = view_root_(view);
+
+	for (round = 1; round <= NR_ROUNDS; round++) {
+		insert_all_(fix, round * NR_KEYS);
+		view_commit_(fix);
+	}
+
+	check_all_(view, root, &fix->info, 0);
+	dm_tm_destroy(view);
+}
+
+static void test_view_sees_last_commit(void *context)
+{
+	struct view_fixture *fix = context;
+	struct dm_transaction_manager *view;
+
+	// Uncommitted changes aren't seen.
+	insert_all_(fix, NR_KEYS);
+	view = dm_tm_open_view(fix->tf.tm);
+	T_ASSERT(!IS_ERR(view));
+	check_all_(view, view_root_(view), &fix->info, 0);
+	dm_tm_destroy(view);
+
+	view_commit_(fix);
+	view = dm_tm_open_view(fix->tf.tm);
+	T_ASSERT(!IS_ERR(view));
+	check_all_(view, view_root_(view), &fix->info, NR_KEYS);
+	dm_tm_destroy(view);
+}
+
+static void test_view_is_read_only(void *context)
+{
+	int inc;
+	uint32_t count;
+	struct view_fixture *fix = context;
+	struct dm_transaction_manager *view = dm_tm_open_view(fix->tf.tm);
+	struct dm_block *b;
+
+	T_ASSERT(!IS_ERR(view));
+	T_ASSERT_EQUAL(dm_tm_new_block(view, NULL, &b), -EWOULDBLOCK);
+	T_ASSERT_EQUAL(dm_tm_shadow_block(view, view_root_(view), NULL, &b, &inc), -EWOULDBLOCK);
+	T_ASSERT_EQUAL(dm_tm_ref(view, view_root_(view), &count), -EINVAL);
+
+	// Goes to the real tm.
+	dm_tm_issue_prefetches(view);
+	dm_tm_destroy(view);
+}
+
+static void test_quarantine_released(void *context)
+{
+	unsigned round;
+	struct view_fixture *fix = context;
+	struct dm_transaction_manager *view = dm_tm_open_view(fix->tf.tm);
+	dm_block_t held, released;
+
+	T_ASSERT(!IS_ERR(view));
+
+	for (round = 1; round <= NR_ROUNDS; round++) {
+		insert_all_(fix, round * NR_KEYS);
+		view_commit_(fix);
+	}
+	T_ASSERT(!dm_sm_get_nr_free(fix->tf.sm, &held));
+
+	// The blocks are given back at the next commit, and the space map
+	// counts them as free after the one after that.
+	dm_tm_destroy(view);
+	view_commit_(fix);
+	view_commit_(fix);
+	T_ASSERT(!dm_sm_get_nr_free(fix->tf.sm, &released));
+	T_ASSERT(released > held);
+}
+
+struct reader {
+	struct view_fixture *fix;
+	bool stop;
+	unsigned nr_checks;
+};
+
+static void *reader_(void *context)
+{
+	struct reader *r = context;
+	struct dm_transaction_manager *view;
+	uint64_t k, v, offset;
+	struct dm_btree_info info = r->fix->info;
+	dm_block_t root;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		view = dm_tm_open_view(r->fix->tf.tm);
+		T_ASSERT(!IS_ERR(view));
+
+		// Every committed tree has values offset by the same amount.
+		info.tm = view;
+		root = view_root_(view);
+		k = 0;
+		T_ASSERT(!dm_btree_lookup(&info, root, &k, &offset));
+		for (k = 1; k < NR_KEYS; k += 7) {
+			T_ASSERT(!dm_btree_lookup(&info, root, &k, &v));
+			T_ASSERT_EQUAL(v, k + offset);
+		}
+
+		dm_tm_destroy(view);
+		r->nr_checks++;
+	}
+
+	return NULL;
+}
+
+static void test_view_concurrent_with_writer(void *context)
+{
+	unsigned round;
+	pthread_t t;
+	struct reader r = {.fix = context, .stop = false, .nr_checks = 0};
+
+	T_ASSERT(!pthread_create(&t, NULL, reader_, &r));
+	for (round = 1; round <= NR_ROUNDS; round++) {
+		insert_all_(r.fix, round * NR_KEYS);
+		view_commit_(r.fix);
+	}
+	__atomic_store_n(&r.stop, true, __ATOMIC_RELEASE);
+	T_ASSERT(!pthread_join(t, NULL));
+
+	T_ASSERT(r.nr_checks > 0);
+}
+
+//--------------------------------------------------------
+
+#define T(path, desc, fn) register_test(ts, "/tm/" path, desc, fn)
+
+static struct test_suite *shadow_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_tm_, destroy_tm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("shadow/new-blocks", "new blocks don't need shadowing", test_new_blocks_are_shadows);
+	T("shadow/shadow-of-shadow", "a shadow of a shadow is a no-op", test_shadow_of_shadow);
+	T("shadow/commit", "commit forgets the shadows", test_commit_forgets_shadows);
+	T("shadow/move", "unshared blocks are moved rather than copied", test_shadow_moves_buffer);
+	T("shadow/shared", "shared blocks are copied", test_shared_block_is_copied);
+
+	return ts;
+}
+
+static struct test_suite *view_tests(void)
+{
+	struct test_suite *ts = test_suite_create(create_view_tm_, destroy_view_tm_);
+	if (!ts) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	T("view/stable", "a view isn't changed by later commits", test_view_is_stable);
+	T("view/last-commit", "a view sees the last commit", test_view_sees_last_commit);
+	T("view/read-only", "a view can't change anything", test_view_is_read_only);
+	T("view/quarantine", "held blocks are released once the view is gone", test_quarantine_released);
+	T("view/concurrent", "views can be read while the writer commits", test_view_concurrent_with_writer);
+
+	return ts;
+}
+
+void transaction_manager_tests(struct list_head *suites)
+{
+	list_add(&shadow_tests()->list, suites);
+	list_add(&view_tests()->list, suites);
+}
+
+//--------------------------------------------------------